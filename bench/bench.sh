@@ -0,0 +1,77 @@
+#!/bin/sh
+# Startup and chain-latency benchmarks; one key=value line per case.
+# Times are nanoseconds per invocation, faults are per invocation, the
+# syscall and exec counts include every child process.  Subtract the
+# "true" baseline (or a chain's prefix) to get the cost of a link.
+#
+# Usage: bench/bench.sh [runs]
+# BENCH_BIN selects the directory holding the utilities (default: the
+# top of the tree); point it at a directory of multicall symlinks to
+# benchmark the emanutils binary instead, with EMANUTILS_INPROCESS=1 in
+# the environment to benchmark its in-process chaining.
+#
+# The syscall budgets are checked by bench/check.sh (make check).
+
+set -u
+
+here=$(cd -- "$(dirname -- "$0")" && pwd) || exit
+runs=${1:-200}
+bin=${BENCH_BIN:-$(dirname -- "$here")}
+PATH=$bin:$PATH
+export PATH
+
+# make's jobserver or the caller may hold low fds the cases use
+exec 3<&- 4<&- 5<&- 6<&- 7<&- 8<&- 9<&-
+
+tmp=$(mktemp -d) || exit
+sleep 3600 3</dev/null &
+target=$!
+trap 'kill "$target" 2>/dev/null; rm -rf -- "$tmp"' EXIT
+trap 'exit 2' HUP INT TERM
+
+i=0
+while [ "$i" -lt 1000 ]; do
+    echo "record $i"
+    i=$((i + 1))
+done >"$tmp/records"
+
+failed=0
+run() {
+    "$here/benchrun" -n "$runs" "$@" || failed=1
+}
+
+run true true
+
+# single links
+run chainif chainif ' true' '' '' true
+run chainif-builtin chainif ' fdcmp' ' 0' ' 0' '' '' true
+run creatememfd creatememfd 3 bench true
+run fdcmp fdcmp 0 0 true
+run fdprefault creatememfd -s 64k 3 bench fdprefault 3 true
+run fdseal creatememfd -S 3 bench fdseal add -s F_SEAL_GROW 3 true
+run fdtruncate creatememfd 3 bench fdtruncate 3 65536 true
+run -i "$tmp/records" mergeeet mergeeet 0
+run openpathfd openpathfd 3 /dev/null true
+run openpidfd openpidfd 3 "$target" true
+run pidfdgetfd openpidfd 4 "$target" pidfdgetfd 4 3 5 true
+run -i /dev/null pollinfd pollinfd 0 true
+run psendfd psendfd "$target" 0 100 true
+run ptytty ptytty 3 4 true
+run secretmemfd secretmemfd 3 true
+
+# wakeup latency of a blocked pollinfd, without and with a spin phase;
+# -w gives the command 2ms (in microseconds) to block before the write
+run -w 2000 pollinfd-block pollinfd 0 true
+run -w 2000 pollinfd-spin pollinfd -s 5ms 0 true
+
+# representative chains
+run chain-memfd creatememfd -S 3 bench fdtruncate 3 65536 \
+    fdseal add -s F_SEAL_GROW -s F_SEAL_SHRINK 3 \
+    pollinfd -t 0 3:out true
+run chain-steal openpidfd 4 "$target" pidfdgetfd 4 3 5 \
+    fdcmp -p "$target" 3 3 openpathfd 6 /dev/null true
+run -i /dev/null chain-condition chainif -c 2 \
+    ' fdcmp' ' 0' ' 0' '' ' pollinfd' ' 0' '' '' \
+    creatememfd 3 bench pollinfd 0 true
+
+exit "$failed"
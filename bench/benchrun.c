@@ -0,0 +1,354 @@
+#define _GNU_SOURCE /* __WALL */
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct result {
+    int status;
+    long long wall;
+    struct rusage ru;
+};
+
+static void
+usage(void)
+{
+    static char const msg[] =
+        "Usage: benchrun [-i file|-w delay] [-n runs] [-s budget] name "
+        "cmd [args]...\n";
+    if (fputs(msg, stderr) == EOF)
+        perror("fputs");
+}
+
+static long long
+now(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+reopen(int const fd, char const *const path, int const flags)
+{
+    int const newfd = open(path, flags);
+    if (newfd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (newfd != fd) {
+        if (dup2(newfd, fd) == -1) {
+            perror("dup2");
+            return -1;
+        }
+        (void)close(newfd);
+    }
+    return 0;
+}
+
+/*
+ * stdout goes to /dev/null; stdin comes from input, or from the pipe wake
+ * when it is not -1, afresh every run
+ */
+static pid_t
+spawn(char *const *const cmd, char const *const input, int const wake,
+      bool const trace)
+{
+    pid_t const pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid)
+        return pid;
+
+    if (input && reopen(STDIN_FILENO, input, O_RDONLY) == -1)
+        _exit(127);
+    if (wake != -1 && dup2(wake, STDIN_FILENO) == -1) {
+        perror("dup2");
+        _exit(127);
+    }
+    if (reopen(STDOUT_FILENO, "/dev/null", O_WRONLY) == -1)
+        _exit(127);
+    if (trace) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+            perror("ptrace");
+            _exit(127);
+        }
+        if (raise(SIGSTOP) != 0) {
+            perror("raise");
+            _exit(127);
+        }
+    }
+    (void)execvp(*cmd, cmd);
+    perror("execvp");
+    _exit(127);
+}
+
+static int
+exitcode(int const status)
+{
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/*
+ * with a delay, time from the write that wakes the command up on its
+ * stdin, after it had delay nanoseconds to start and block, to its exit
+ */
+static int
+timed(char *const *const cmd, char const *const input, long long const delay,
+      struct result *const r)
+{
+    int wake[2] = { -1, -1 };
+    if (delay >= 0 && pipe2(wake, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    long long start = now();
+    pid_t const pid = spawn(cmd, input, wake[0], false);
+    if (wake[0] != -1)
+        (void)close(wake[0]);
+    if (pid == -1)
+        return -1;
+    if (wake[1] != -1) {
+        struct timespec const ts = {
+            .tv_sec = delay / 1000000000,
+            .tv_nsec = delay % 1000000000,
+        };
+        while (nanosleep(&ts, NULL) == -1 && errno == EINTR)
+            ;
+        start = now();
+        if (write(wake[1], "", 1) == -1)
+            perror("write");
+        (void)close(wake[1]);
+    }
+    int status;
+    while (wait4(pid, &status, 0, &r->ru) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return -1;
+        }
+    }
+    r->wall = now() - start;
+    r->status = exitcode(status);
+    return 0;
+}
+
+/* count syscall entries and execs of the command and all its children */
+static int
+traced(char *const *const cmd, char const *const input,
+       unsigned long *const syscallsp, unsigned long *const execsp)
+{
+    pid_t const pid = spawn(cmd, input, -1, true);
+    if (pid == -1)
+        return -1;
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return -1;
+    }
+    if (!WIFSTOPPED(status)) {
+        if (fputs("benchrun: tracee did not stop.\n", stderr) == EOF)
+            perror("fputs");
+        return -1;
+    }
+    long const options =
+        PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC |
+        PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)options) == -1 ||
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1) {
+        perror("ptrace");
+        (void)kill(pid, SIGKILL);
+        return -1;
+    }
+
+    /* only what happens from the first execve(2) on is counted */
+    bool started = false;
+    unsigned long syscalls = 1;
+    unsigned long execs = 0;
+    for (;;) {
+        pid_t const tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ECHILD)
+                break;
+            perror("waitpid");
+            return -1;
+        }
+        if (!WIFSTOPPED(status))
+            continue;
+
+        int const sig = WSTOPSIG(status);
+        int const event = status >> 16;
+        int deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            long const ret = ptrace(PTRACE_GET_SYSCALL_INFO, tid,
+                                    (void *)sizeof info, &info);
+            if (started && ret > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+                ++syscalls;
+        } else if (sig == SIGTRAP && event == PTRACE_EVENT_EXEC) {
+            started = true;
+            ++execs;
+        } else if (sig == SIGTRAP && event) {
+            /* fork, vfork or clone: the child is traced automatically */
+        } else if (sig != SIGSTOP) {
+            deliver = sig;
+        }
+        if (ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)deliver) == -1 &&
+            errno != ESRCH) {
+            perror("ptrace");
+            return -1;
+        }
+    }
+
+    *syscallsp = syscalls;
+    *execsp = execs;
+    return 0;
+}
+
+static int
+compare(void const *const a, void const *const b)
+{
+    long long const x = *(long long const *)a;
+    long long const y = *(long long const *)b;
+    return (x > y) - (x < y);
+}
+
+int
+main(int const argc, char **const argv)
+{
+    char const *input = NULL;
+    long long delay = -1;
+    long runs = 100;
+    long budget = -1;
+    for (int opt; opt = getopt(argc, argv, "+i:n:s:w:"), opt != -1;) {
+        switch (opt) {
+        case 'i':
+            input = optarg;
+            break;
+        case 'w': {
+            char *endptr;
+            errno = 0;
+            delay = strtoll(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || delay < 0 ||
+                delay > LLONG_MAX / 1000) {
+                if (fputs("Invalid delay.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            delay *= 1000;
+            break;
+        }
+        case 'n': {
+            char *endptr;
+            errno = 0;
+            runs = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || runs < 1 ||
+                runs > INT_MAX) {
+                if (fputs("Invalid runs.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            break;
+        }
+        case 's': {
+            char *endptr;
+            errno = 0;
+            budget = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || budget < 0) {
+                if (fputs("Invalid budget.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            break;
+        }
+        default:
+            usage();
+            return 2;
+        }
+    }
+
+    if (argc - optind < 2 || (input && delay >= 0)) {
+        usage();
+        return 2;
+    }
+
+    char const *const name = argv[optind];
+    char *const *const cmd = &argv[optind + 1];
+
+    long long *const walls = malloc(runs * sizeof *walls);
+    if (!walls) {
+        perror("malloc");
+        return 2;
+    }
+
+    /* one warm-up run to fill the page cache */
+    struct result r;
+    if (timed(cmd, input, delay, &r) == -1)
+        return 2;
+
+    long minflt = 0;
+    long majflt = 0;
+    long maxrss = 0;
+    for (long i = 0; i < runs; ++i) {
+        if (timed(cmd, input, delay, &r) == -1)
+            return 2;
+        walls[i] = r.wall;
+        minflt += r.ru.ru_minflt;
+        majflt += r.ru.ru_majflt;
+        if (r.ru.ru_maxrss > maxrss)
+            maxrss = r.ru.ru_maxrss;
+    }
+    qsort(walls, runs, sizeof *walls, compare);
+
+    unsigned long syscalls;
+    unsigned long execs;
+    if (traced(cmd, input, &syscalls, &execs) == -1)
+        return 2;
+
+    int const ret = printf(
+        "name=%s status=%d runs=%ld wall_min=%lld wall_median=%lld "
+        "wall_p90=%lld wall_p99=%lld wall_max=%lld syscalls=%lu "
+        "execs=%lu minflt=%ld majflt=%ld maxrss=%ld",
+        name, r.status, runs, walls[0], walls[runs / 2],
+        walls[runs * 9 / 10], walls[runs * 99 / 100], walls[runs - 1],
+        syscalls, execs, minflt / runs,
+        majflt / runs, maxrss);
+    if (ret < 0 || (budget >= 0 && printf(" budget=%ld", budget) < 0) ||
+        putchar('\n') == EOF || fflush(stdout) == EOF) {
+        perror("printf");
+        return 2;
+    }
+
+    /* more syscalls than the budget fails the run */
+    if (budget >= 0 && syscalls > (unsigned long)budget) {
+        static char const efmt[] =
+            "benchrun: %s: %lu syscalls, over the budget of %ld.\n";
+        if (fprintf(stderr, efmt, name, syscalls, budget) < 0)
+            perror("fprintf");
+        return 1;
+    }
+    /* so does a cmd that failed, and may have stopped short of its work */
+    if (budget >= 0 && r.status) {
+        static char const efmt[] = "benchrun: %s: exited with %d.\n";
+        if (fprintf(stderr, efmt, name, r.status) < 0)
+            perror("fprintf");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#!/bin/sh
+# Syscall budget checks, one benchrun -n 1 per utility; exits 1 when a
+# utility makes more syscalls than it needs to.
+#
+# Usage: bench/check.sh
+#
+# A budget is what the commands cost when they do nothing but start and
+# exec the next link, plus each utility's own work.  Those baselines are
+# measured with bench/link, which does nothing but that, so the budgets
+# do not depend on the libc nor on any utility.  Every exec is given an
+# absolute path so that no PATH search gets counted.
+
+set -u
+
+here=$(cd -- "$(dirname -- "$0")" && pwd) || exit
+bin=$(dirname -- "$here")
+link=$here/link
+
+truepath=
+IFS=:
+for dir in $PATH; do
+    if [ -f "$dir/true" ] && [ -x "$dir/true" ]; then
+        truepath=$dir/true
+        break
+    fi
+done
+unset IFS
+if [ -z "$truepath" ]; then
+    echo 'check.sh: true not found.' >&2
+    exit 2
+fi
+
+# make's jobserver or the caller may hold low fds the cases use
+exec 3<&- 4<&- 5<&- 6<&- 7<&- 8<&- 9<&-
+
+tmp=$(mktemp -d) || exit
+sleep 3600 3</dev/null &
+target=$!
+trap 'kill "$target" 2>/dev/null; rm -rf -- "$tmp"' EXIT
+trap 'exit 2' HUP INT TERM
+
+i=0
+while [ "$i" -lt 1000 ]; do
+    echo "record $i"
+    i=$((i + 1))
+done >"$tmp/records"
+
+failed=0
+# a cmd that fails early makes fewer syscalls, so it has to exit 0 too
+check() {
+    out=$("$here/benchrun" -n 1 -s "$@") || failed=1
+    printf '%s\n' "$out"
+    case $out in
+    *' status=0 '*) ;;
+    *) failed=1 ;;
+    esac
+}
+
+syscalls() {
+    "$here/benchrun" -n 1 x "$@" | sed -n 's/.* syscalls=\([0-9]*\).*/\1/p'
+}
+
+# true on its own; a link started and exec'd; the first malloc(3); a
+# posix_spawn(3) of true, without the waitpid(2)
+base=$(syscalls "$truepath")
+start=$(($(syscalls "$link" "$truepath") - base))
+malloc=$(($(syscalls "$link" -m "$truepath") - base - start))
+spawn=$(($(syscalls "$link" -s "$truepath" "$truepath") - base - start - 1))
+one=$((base + start))
+two=$((base + 2 * start))
+
+# malloc, the spawn, pidfd_open(2), poll(2), waitid(2), close(2)
+check $((one + malloc + spawn + 4)) chainif \
+    "$bin/chainif" " $truepath" '' '' "$truepath"
+# malloc, getpid(2), F_GETFD of both fds, kcmp(2)
+check $((one + malloc + 4)) chainif-builtin \
+    "$bin/chainif" ' fdcmp' ' 0' ' 0' '' '' "$truepath"
+# memfd_create(2) lands on fd 3
+check $((one + 1)) creatememfd-samefd \
+    "$bin/creatememfd" 3 check "$truepath"
+# memfd_create(2), dup2(2), close(2)
+check $((one + 3)) creatememfd-otherfd \
+    "$bin/creatememfd" 9 check "$truepath"
+# one memfd_create(2) each, landing on fds 3 to 6
+check $((one + 4)) creatememfd-pool \
+    "$bin/creatememfd" -n 4 3 'check%d' "$truepath"
+# memfd_create(2), openat(2), copy_file_range(2) refused across
+# filesystems, sendfile(2) until it returns 0, close(2), lseek(2)
+check $((one + 7)) creatememfd-fill \
+    "$bin/creatememfd" -i "$tmp/records" 3 check "$truepath"
+# the filled memfd reads back from its start through the inherited fd
+if ! "$bin/creatememfd" -i "$tmp/records" 0 check \
+    cmp -s -- - "$tmp/records"; then
+    echo 'check.sh: creatememfd-fill: the memfd does not read back.' >&2
+    failed=1
+fi
+# getpid(2), kcmp(2)
+check $((one + 2)) fdcmp "$bin/fdcmp" 0 0 "$truepath"
+# memfd_create(2), ftruncate(2); fstat(2), geteuid(2), malloc, mmap(2),
+# mincore(2), madvise(2), mincore(2), munmap(2)
+check $((two + 2 + malloc + 7)) fdprefault \
+    "$bin/creatememfd" -s 64k 3 check "$bin/fdprefault" 3 "$truepath"
+# memfd_create(2); F_ADD_SEALS
+check $((two + 2)) fdseal \
+    "$bin/creatememfd" -S 3 check \
+    "$bin/fdseal" add -s F_SEAL_GROW 3 "$truepath"
+# memfd_create(2); ftruncate(2)
+check $((two + 2)) fdtruncate \
+    "$bin/creatememfd" 3 check "$bin/fdtruncate" 3 65536 "$truepath"
+# malloc, then poll(2), read(2) and close(2) as it exits without a cmd
+check $((base + malloc + 3)) -i /dev/null mergeeet-empty \
+    "$bin/mergeeet" -L 0
+# as above, plus poll(2), read(2) and one writev(2) per PIPE_BUF chunk
+size=$(wc -c <"$tmp/records")
+chunks=$(((size + 4095) / 4096))
+check $((base + malloc + 3 + 3 * chunks)) -i "$tmp/records" \
+    mergeeet-records "$bin/mergeeet" -L 0
+# openat(2) lands on fd 3
+check $((one + 1)) openpathfd-samefd \
+    "$bin/openpathfd" 3 /dev/null "$truepath"
+# openat(2), dup2(2), close(2)
+check $((one + 3)) openpathfd-otherfd \
+    "$bin/openpathfd" 9 /dev/null "$truepath"
+# pidfd_open(2) lands on fd 3, then F_SETFD
+check $((one + 2)) openpidfd-samefd \
+    "$bin/openpidfd" 3 "$target" "$truepath"
+# pidfd_open(2), dup2(2); the pidfd is closed by the exec
+check $((one + 2)) openpidfd-otherfd \
+    "$bin/openpidfd" 9 "$target" "$truepath"
+# pidfd_open(2), dup2(2); pidfd_getfd(2), dup2(2)
+check $((two + 4)) pidfdgetfd \
+    "$bin/openpidfd" 4 "$target" "$bin/pidfdgetfd" 4 3 5 "$truepath"
+# malloc, ppoll(2)
+check $((one + malloc + 1)) -i /dev/null pollinfd \
+    "$bin/pollinfd" 0 "$truepath"
+# PTRACE_ATTACH, wait4(2), PTRACE_GETREGS, PTRACE_PEEKTEXT,
+# PTRACE_POKETEXT, getpid(2); pidfd_open, pidfd_getfd, dup2 and two close
+# injected at 7 each (PTRACE_SETREGS, then PTRACE_SYSCALL, wait4(2) and
+# PTRACE_PEEKUSER on entry and on exit); PTRACE_POKETEXT,
+# PTRACE_SETREGS, PTRACE_DETACH
+check $((one + 6 + 5 * 7 + 3)) psendfd \
+    "$bin/psendfd" "$target" 0 100 "$truepath"
+# openat(2) of /dev/ptmx on fd 3, an ioctl(2) each for grantpt(3),
+# unlockpt(3) and ptsname(3), openat(2) of the tty on fd 4
+check $((one + 5)) ptytty "$bin/ptytty" 3 4 "$truepath"
+# memfd_secret(2) lands on fd 3
+check $((one + 1)) secretmemfd "$bin/secretmemfd" 3 "$truepath"
+
+exit "$failed"
@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/*
+ * a link that does nothing but exec the rest of the chain, so that what
+ * it costs beyond its execve(2) is what starting any utility costs; -m
+ * adds the cost of a first malloc(3) and -s that of spawning path and
+ * waiting for it, the libc parts of some utilities' work
+ */
+int
+main(int const argc, char *const *const argv)
+{
+    char *path = NULL;
+    for (int opt; opt = getopt(argc, argv, "+ms:"), opt != -1;) {
+        switch (opt) {
+        case 'm':
+            if (!malloc(1)) {
+                perror("malloc");
+                return 2;
+            }
+            break;
+        case 's':
+            path = optarg;
+            break;
+        default:
+            return 2;
+        }
+    }
+    if (argc - optind < 1) {
+        if (fputs("Usage: link [-m] [-s path] cmd [args]...\n",
+                  stderr) == EOF) {
+            perror("fputs");
+        }
+        return 2;
+    }
+
+    if (path) {
+        pid_t pid;
+        int const ret = posix_spawn(&pid, path, NULL, NULL,
+                                    (char *[]){ path, NULL }, environ);
+        if (ret) {
+            errno = ret;
+            perror("posix_spawn");
+            return 2;
+        }
+        while (waitpid(pid, NULL, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                return 2;
+            }
+        }
+    }
+
+    (void)execvp(argv[optind], &argv[optind]);
+    perror("execvp");
+    return 2;
+}
@@ -1,14 +1,27 @@
+#define _GNU_SOURCE /* F_GET_SEALS, F_SEAL_* */
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <fcntl.h>
+#include <linux/kcmp.h>
+#include <poll.h>
 #include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 extern char **environ;
 
 static char **
@@ -30,73 +43,889 @@ static void
 usage(void)
 {
     static char const message[] =
-        "Usage: chainif [-AEn] { condition... } { chain... } cmd...\n";
+        "Usage: chainif [-ABEno] [-c count] [-C cachefile [-T ttl] "
+        "[-V name]...] [-R fd]\n"
+        "               [-t timeout] { condition... }... { chain... } "
+        "cmd...\n";
     if (fputs(message, stderr) == EOF)
         perror("fputs");
 }
 
+/* like the PATH search of execvp(3), but done once, in the parent */
+static char *
+findexec(char const *const name)
+{
+    size_t const namelen = strlen(name);
+    if (!namelen) {
+        errno = ENOENT;
+        perror("findexec");
+        return NULL;
+    }
+    if (strchr(name, '/')) {
+        char *const path = strdup(name);
+        if (!path)
+            perror("strdup");
+        return path;
+    }
+
+    char const *pathenv = getenv("PATH");
+    if (!pathenv)
+        pathenv = "/bin:/usr/bin";
+    char *const path = malloc(strlen(pathenv) + 1 + namelen + 1);
+    if (!path) {
+        perror("malloc");
+        return NULL;
+    }
+    for (char const *dir = pathenv;; ++dir) {
+        size_t const dirlen = strcspn(dir, ":");
+        char *p = path;
+        if (dirlen) {
+            (void)memcpy(p, dir, dirlen);
+            p += dirlen;
+            *p++ = '/';
+        }
+        (void)memcpy(p, name, namelen + 1);
+        /* like execvp(3): a regular file the effective ids may execute */
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0) {
+            return path;
+        }
+        dir += dirlen;
+        if (!*dir)
+            break;
+    }
+    free(path);
+
+    static char const efmt[] = "%s: command not found.\n";
+    if (fprintf(stderr, efmt, name) < 0)
+        perror("fprintf");
+    return NULL;
+}
+
+struct condition {
+    char **argv;
+    int pidfd;
+    int pollfd;
+    long long deadline;
+    int status;
+    bool resolved;
+    bool killed;
+    char const *how;
+    long long start;
+    long long end;
+    struct rusage ru;
+};
+
+static struct sealinfo {
+    int flag;
+    char const *string;
+} const sealinfos[] = {
+#define SEAL(s) { F_SEAL_ ## s, "F_SEAL_" #s, }
+    SEAL(SEAL),
+    SEAL(SHRINK),
+    SEAL(GROW),
+    SEAL(WRITE),
+    SEAL(FUTURE_WRITE),
+    SEAL(EXEC),
+#undef SEAL
+    { 0 },
+};
+
+enum {
+    CACHE_SLOTS = 1024,
+    /* about 68 years, which keeps now plus ttl far from overflowing */
+    CACHE_MAXTTL = INT32_MAX,
+};
+
+struct cache {
+    int fd;
+    long ttl;
+    char const **names;
+    size_t nnames;
+};
+
+/* a slot is only trusted if check matches, so concurrent writers can at
+ * worst cause a miss */
+struct cacherecord {
+    uint64_t key;
+    int64_t expires;
+    int32_t status;
+    uint32_t check;
+};
+
+static uint64_t
+fnv1a(uint64_t hash, char const *const str, size_t const len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+static uint64_t
+cache_key(struct cache const *const cache, char *const *const argv)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (char *const *arg = argv; *arg; ++arg)
+        hash = fnv1a(hash, *arg, strlen(*arg) + 1);
+    hash = fnv1a(hash, "", 1);
+    for (size_t i = 0; i < cache->nnames; ++i) {
+        char const *const name = cache->names[i];
+        char const *const value = getenv(name);
+        hash = fnv1a(hash, name, strlen(name) + 1);
+        hash = value
+            ? fnv1a(hash, value, strlen(value) + 1)
+            : fnv1a(hash, "\xff", 1);
+    }
+    return hash;
+}
+
+static uint32_t
+cache_check(struct cacherecord const *const r)
+{
+    uint64_t h = r->key ^ (uint64_t)r->expires * UINT64_C(0x9e3779b97f4a7c15)
+        ^ (uint64_t)(uint32_t)r->status << 17;
+    h = (h ^ h >> 30) * UINT64_C(0xbf58476d1ce4e5b9);
+    h = (h ^ h >> 27) * UINT64_C(0x94d049bb133111eb);
+    return (uint32_t)(h ^ h >> 31 ^ h >> 32);
+}
+
+static int64_t
+cache_now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
+        perror("clock_gettime");
+        return -1;
+    }
+    return ts.tv_sec;
+}
+
+/* true on a hit, storing the cached status in c->status; errors are
+ * treated as misses */
+static bool
+cache_lookup(struct cache const *const cache, struct condition *const c)
+{
+    uint64_t const key = cache_key(cache, c->argv);
+    struct cacherecord r;
+    off_t const off = key % CACHE_SLOTS * sizeof r;
+    if (pread(cache->fd, &r, sizeof r, off) != sizeof r)
+        return false;
+    if (r.key != key || r.check != cache_check(&r))
+        return false;
+    int64_t const t = cache_now();
+    if (t == -1 || t >= r.expires)
+        return false;
+    c->status = r.status;
+    return true;
+}
+
+static void
+cache_store(struct cache const *const cache, struct condition const *const c)
+{
+    int64_t const t = cache_now();
+    if (t == -1 || t > INT64_MAX - cache->ttl)
+        return;
+    struct cacherecord r = {
+        .key = cache_key(cache, c->argv),
+        .expires = t + cache->ttl,
+        .status = c->status,
+    };
+    r.check = cache_check(&r);
+    off_t const off = r.key % CACHE_SLOTS * sizeof r;
+    if (pwrite(cache->fd, &r, sizeof r, off) == -1)
+        perror("pwrite");
+}
+
+static int
+str2nonneg(char const *const str)
+{
+    char *endptr;
+    errno = 0;
+    long const num = strtol(str, &endptr, 10);
+    if (errno || endptr == str || num < 0 || num > INT_MAX || *endptr)
+        return -1;
+    return (int)num;
+}
+
+static long long
+now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        perror("clock_gettime");
+        return -1;
+    }
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* The builtins evaluate `fdcmp', `fdseal check' and `pollinfd'
+ * conditions without spawning them, with the same exit status.  They
+ * return false, leaving the condition to be spawned, for anything they
+ * do not handle: other options, trailing commands, invalid arguments.
+ * A `pollinfd' condition is only set up here; its fd is polled along
+ * with the pidfds of the other conditions.  Our own close-on-exec fds,
+ * like the -C cache, would be gone in a spawned tool, so conditions on
+ * them are spawned too.  */
+
+static bool
+cloexec(int const fd)
+{
+    int const flags = TRACE("fcntl", fcntl(fd, F_GETFD));
+    return flags != -1 && (flags & FD_CLOEXEC);
+}
+
+static bool
+builtin_fdcmp(struct condition *const c, int const argc)
+{
+    bool flags[4] = { false };
+    bool negateflag = false;
+    char const *pidstrs[2] = { NULL, NULL };
+    for (int opt; opt = getopt(argc, c->argv, "+0123enp:P:"), opt != -1;) {
+        switch (opt) {
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+            flags[opt - '0'] = true;
+            break;
+        case 'e':
+            break;
+        case 'n':
+            negateflag = true;
+            break;
+        case 'p':
+        case 'P':
+            pidstrs[opt == 'P'] = optarg;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (argc - optind != 2)
+        return false;
+    if (!(flags[1] || flags[2] || flags[3]))
+        flags[0] = true;
+
+    int const fd1 = str2nonneg(c->argv[optind]);
+    int const fd2 = str2nonneg(c->argv[optind + 1]);
+    int const pid1 = pidstrs[0] ? str2nonneg(pidstrs[0]) : getpid();
+    int const pid2 = pidstrs[1] ? str2nonneg(pidstrs[1]) : pid1;
+    if (fd1 == -1 || fd2 == -1 || pid1 == -1 || pid2 == -1)
+        return false;
+    if ((!pidstrs[0] && cloexec(fd1)) ||
+        (!pidstrs[0] && !pidstrs[1] && cloexec(fd2))) {
+        return false;
+    }
+
+    int const res = TRACE("kcmp", syscall(SYS_kcmp, pid1, pid2, KCMP_FILE,
+                                          fd1, fd2));
+    if (res == -1) {
+        perror("kcmp");
+        c->status = 2;
+    } else {
+        c->status = flags[res] == negateflag;
+    }
+    return true;
+}
+
+static bool
+builtin_fdseal(struct condition *const c, int const argc)
+{
+    if (argc < 2 || strcmp(c->argv[1], "check"))
+        return false;
+
+    bool exactflag = false;
+    bool negateflag = false;
+    int seals = 0;
+    for (int opt; opt = getopt(argc - 1, &c->argv[1], "+ns:x"), opt != -1;) {
+        switch (opt) {
+        case 'n':
+            negateflag = true;
+            break;
+        case 's': {
+            struct sealinfo const *si = sealinfos;
+            while (si->flag && strcmp(optarg, si->string))
+                ++si;
+            if (!si->flag)
+                return false;
+            seals |= si->flag;
+            break;
+        }
+        case 'x':
+            exactflag = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (argc - 1 - optind != 1)
+        return false;
+    int const fd = str2nonneg(c->argv[1 + optind]);
+    if (fd == -1 || cloexec(fd))
+        return false;
+
+    int fdseals = TRACE("fcntl", fcntl(fd, F_GET_SEALS));
+    if (fdseals == -1) {
+        perror("fcntl(F_GET_SEALS)");
+        c->status = 2;
+        return true;
+    }
+    if (!exactflag)
+        fdseals &= seals;
+    c->status = (fdseals == seals) == negateflag;
+    return true;
+}
+
+static bool
+builtin_pollinfd(struct condition *const c, int const argc)
+{
+    int timeout = -1;
+    for (int opt; opt = getopt(argc, c->argv, "+t:"), opt != -1;) {
+        switch (opt) {
+        case 't': {
+            char *endptr;
+            errno = 0;
+            long const num = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || num < INT_MIN ||
+                num > INT_MAX || *endptr) {
+                return false;
+            }
+            timeout = (int)num;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    if (argc - optind != 1)
+        return false;
+    int const fd = str2nonneg(c->argv[optind]);
+    if (fd == -1 || cloexec(fd))
+        return false;
+
+    c->deadline = -1;
+    if (timeout >= 0) {
+        c->deadline = now();
+        if (c->deadline == -1)
+            return false;
+        c->deadline += timeout * 1000LL;
+    }
+    c->pollfd = fd;
+    return true;
+}
+
+static void
+builtin_pollinfd_done(struct condition *const c, short const revents)
+{
+    if (revents & POLLNVAL) {
+        static char const epollnval[] =
+            "File descriptor cannot be used with poll.\n";
+        if (fputs(epollnval, stderr) == EOF)
+            perror("fputs");
+        c->status = 2;
+        return;
+    }
+    c->status = !(revents & POLLIN);
+}
+
+static bool
+builtin(struct condition *const c)
+{
+    static struct {
+        char const *name;
+        bool (*fn)(struct condition *, int);
+    } const builtins[] = {
+        { "fdcmp", builtin_fdcmp, },
+        { "fdseal", builtin_fdseal, },
+        { "pollinfd", builtin_pollinfd, },
+    };
+
+    for (size_t i = 0; i < sizeof builtins / sizeof *builtins; ++i) {
+        if (strcmp(*c->argv, builtins[i].name))
+            continue;
+        int argc = 0;
+        while (c->argv[argc])
+            ++argc;
+        optind = 0;
+        opterr = 0;
+        c->how = "builtin";
+        c->start = now();
+        bool const ret = builtins[i].fn(c, argc);
+        c->end = now();
+        opterr = 1;
+        return ret;
+    }
+    return false;
+}
+
+static bool
+spawncondition(struct condition *const c)
+{
+    char *const path = findexec(*c->argv);
+    if (!path)
+        return false;
+
+    c->how = "spawn";
+    c->start = now();
+    pid_t pid;
+    int const ret = posix_spawn(&pid, path, NULL, NULL, c->argv, environ);
+    free(path);
+    if (ret) {
+        errno = ret;
+        perror("posix_spawn");
+        return false;
+    }
+
+    c->pidfd = TRACE("pidfd_open", syscall(SYS_pidfd_open, pid, 0));
+    if (c->pidfd == -1) {
+        perror("pidfd_open");
+        /* nothing else would ever wait for it */
+        (void)kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        return false;
+    }
+    return true;
+}
+
+static bool
+killcondition(struct condition const *const c)
+{
+    if (syscall(SYS_pidfd_send_signal, c->pidfd, SIGKILL, NULL, 0) == -1 &&
+        errno != ESRCH) {
+        perror("pidfd_send_signal");
+        return false;
+    }
+    return true;
+}
+
+/* stores the exit status of the condition like a shell would */
+static bool
+reapcondition(struct condition *const c)
+{
+    /* the waitid system call, unlike glibc's wrapper, returns rusage */
+    siginfo_t info;
+    while (syscall(SYS_waitid, P_PIDFD, c->pidfd, &info, WEXITED, &c->ru)
+           == -1) {
+        if (errno != EINTR) {
+            perror("waitid");
+            return false;
+        }
+    }
+    c->end = now();
+    (void)close(c->pidfd);
+    c->pidfd = -1;
+    if (c->killed)
+        c->how = "killed";
+
+    c->status = info.si_code == CLD_EXITED
+        ? info.si_status & 0xff
+        : 128 + info.si_status;
+    return true;
+}
+
+/* runs the conditions in parallel; returns the status that decided the
+ * outcome (0 if it is true), or -1 */
+static int
+runconditions(struct condition *const conds, size_t const n,
+              bool const orflag, int const timeout, bool const builtins,
+              struct cache const *const cache)
+{
+    struct pollfd *const pollfds = calloc(n, sizeof *pollfds);
+    if (!pollfds) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        pollfds[i].fd = -1;
+
+    int ret = -1;
+    int decided = -1;
+    int laststatus = 0;
+    for (size_t i = 0; i < n && decided == -1; ++i) {
+        if (*conds[i].argv) {
+            if (builtins && builtin(&conds[i])) {
+                if (conds[i].pollfd != -1)
+                    continue;
+            } else if (!cache || !cache_lookup(cache, &conds[i])) {
+                continue;
+            } else {
+                conds[i].how = "cached";
+            }
+        } else {
+            conds[i].status = 0;
+        }
+        conds[i].resolved = true;
+        laststatus = conds[i].status;
+        if (orflag ? !laststatus : laststatus)
+            decided = laststatus;
+    }
+
+    size_t running = 0;
+    for (size_t i = 0; i < n && decided == -1; ++i) {
+        if (conds[i].resolved)
+            continue;
+        if (conds[i].pollfd != -1) {
+            pollfds[i].fd = conds[i].pollfd;
+        } else {
+            if (!spawncondition(&conds[i]))
+                goto done;
+            pollfds[i].fd = conds[i].pidfd;
+        }
+        pollfds[i].events = POLLIN;
+        ++running;
+    }
+
+    long long deadline = -1;
+    if (timeout >= 0) {
+        deadline = now();
+        if (deadline == -1)
+            goto done;
+        deadline += timeout * 1000LL;
+    }
+
+    while (running && decided == -1) {
+        long long t = -1;
+        long long nextdeadline = deadline;
+        for (size_t i = 0; i < n; ++i) {
+            long long const d = conds[i].deadline;
+            if (pollfds[i].fd != -1 && conds[i].pollfd != -1 && d != -1 &&
+                (nextdeadline == -1 || d < nextdeadline)) {
+                nextdeadline = d;
+            }
+        }
+        int left = -1;
+        if (nextdeadline != -1) {
+            t = now();
+            if (t == -1)
+                goto done;
+            long long const ms = (nextdeadline - t + 999) / 1000;
+            left = ms <= 0 ? 0 : ms > INT_MAX ? INT_MAX : (int)ms;
+        }
+        int const nready = TRACE("poll", poll(pollfds, n, left));
+        if (nready == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            goto done;
+        }
+        if (nready != 0 || t == -1) {
+            t = now();
+            if (t == -1)
+                goto done;
+        }
+        bool const timedout = deadline != -1 && t >= deadline;
+        if (timedout)
+            deadline = -1;
+
+        for (size_t i = 0; i < n; ++i) {
+            if (pollfds[i].fd == -1)
+                continue;
+            struct condition *const c = &conds[i];
+            if (c->pollfd != -1) {
+                c->end = t;
+                if (pollfds[i].revents) {
+                    builtin_pollinfd_done(c, pollfds[i].revents);
+                } else if (c->deadline != -1 && t >= c->deadline) {
+                    c->status = 1;
+                } else if (timedout) {
+                    c->status = 128 + SIGKILL;
+                    c->how = "killed";
+                } else {
+                    continue;
+                }
+            } else {
+                if (!pollfds[i].revents) {
+                    if (timedout) {
+                        if (!killcondition(c))
+                            goto done;
+                        c->killed = true;
+                    }
+                    continue;
+                }
+                if (!reapcondition(c))
+                    goto done;
+                if (cache && !c->killed)
+                    cache_store(cache, c);
+            }
+            pollfds[i].fd = -1;
+            --running;
+            laststatus = c->status;
+            if (orflag ? !laststatus : laststatus) {
+                decided = laststatus;
+                break;
+            }
+        }
+    }
+    ret = decided != -1 ? decided : orflag ? laststatus : 0;
+
+done:
+    for (size_t i = 0; i < n; ++i) {
+        if (pollfds[i].fd == -1 || conds[i].pollfd != -1)
+            continue;
+        conds[i].killed = true;
+        if (!killcondition(&conds[i]) || !reapcondition(&conds[i]))
+            ret = -1;
+    }
+    free(pollfds);
+    return ret;
+}
+
+/* a compact key=value record, times in microseconds and maxrss in KiB;
+ * the command comes last as it may contain anything */
+static int
+formatusage(char *const buf, size_t const size, long long const wall,
+            struct rusage const *const ru, int const status,
+            char const *const how, char const *const cmd)
+{
+    static char const fmt[] =
+        "status=%d wall=%lld utime=%lld stime=%lld maxrss=%ld minflt=%ld "
+        "majflt=%ld nvcsw=%ld nivcsw=%ld%s%s%s%s";
+    return snprintf(buf, size, fmt, status, wall,
+                    ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec,
+                    ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec,
+                    ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt,
+                    ru->ru_nvcsw, ru->ru_nivcsw,
+                    how ? " how=" : "", how ? how : "",
+                    cmd ? " cmd=" : "", cmd ? cmd : "");
+}
+
+static bool
+reportusage(struct condition const *const conds, size_t const n,
+            int const fd, long long const wall, int const status,
+            bool const envflag)
+{
+    char buf[PIPE_BUF];
+    struct rusage total = { 0 };
+    for (size_t i = 0; i < n; ++i) {
+        struct condition const *const c = &conds[i];
+        if (!c->how)
+            continue;
+        struct rusage const *const ru = &c->ru;
+        total.ru_utime.tv_sec += ru->ru_utime.tv_sec;
+        total.ru_utime.tv_usec += ru->ru_utime.tv_usec;
+        total.ru_stime.tv_sec += ru->ru_stime.tv_sec;
+        total.ru_stime.tv_usec += ru->ru_stime.tv_usec;
+        if (ru->ru_maxrss > total.ru_maxrss)
+            total.ru_maxrss = ru->ru_maxrss;
+        total.ru_minflt += ru->ru_minflt;
+        total.ru_majflt += ru->ru_majflt;
+        total.ru_nvcsw += ru->ru_nvcsw;
+        total.ru_nivcsw += ru->ru_nivcsw;
+        if (fd == -1)
+            continue;
+
+        int sz = formatusage(buf, sizeof buf - 1, c->end - c->start, ru,
+                             c->status, c->how, *c->argv);
+        if (sz < 0) {
+            perror("snprintf");
+            return false;
+        }
+        if ((size_t)sz >= sizeof buf - 1)
+            sz = sizeof buf - 2;
+        buf[sz++] = '\n';
+        /* one write, so that records of concurrent chainifs do not mix */
+        ssize_t ret;
+        do {
+            ret = write(fd, buf, sz);
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            perror("write");
+            return false;
+        }
+    }
+
+    if (!envflag)
+        return true;
+    int const sz = formatusage(buf, sizeof buf, wall, &total, status, NULL,
+                               NULL);
+    if (sz < 0) {
+        perror("snprintf");
+        return false;
+    }
+    if (setenv("CHAINIF_RUSAGE", buf, 1) == -1) {
+        perror("setenv");
+        return false;
+    }
+    return true;
+}
+
 int
 main(int const argc, char **const argv)
 {
+    trace_init("chainif");
     bool appendflag = false;
+    bool builtinsflag = true;
     bool envflag = false;
     bool negateflag = false;
+    bool orflag = false;
+    int count = 1;
+    int timeout = -1;
+    char const *cachepath = NULL;
+    bool ttlflag = false;
+    int usagefd = -1;
+    struct cache cache = {
+        .ttl = 60,
+    };
 
-    for (int opt; (opt = getopt(argc, argv, "+AEn")) != -1;) {
+    cache.names = malloc(argc * sizeof *cache.names);
+    if (!cache.names) {
+        perror("malloc");
+        return 2;
+    }
+
+    for (int opt; (opt = getopt(argc, argv, "+ABc:C:EnoR:t:T:V:")) != -1;) {
         switch (opt) {
         case 'A':
             appendflag = true;
             break;
+        case 'B':
+            builtinsflag = false;
+            break;
         case 'E':
             envflag = true;
             break;
+        case 'c': {
+            char *endptr;
+            errno = 0;
+            long const num = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || num < 1 || num > INT_MAX || *endptr) {
+                if (fputs("Invalid count.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            count = (int)num;
+            break;
+        }
+        case 'C':
+            cachepath = optarg;
+            break;
         case 'n':
             negateflag = true;
             break;
+        case 'o':
+            orflag = true;
+            break;
+        case 't': {
+            char *endptr;
+            errno = 0;
+            long const num = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || num < INT_MIN || num > INT_MAX ||
+                *endptr) {
+                if (fputs("Invalid timeout.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            timeout = (int)num;
+            break;
+        }
+        case 'R': {
+            char *endptr;
+            errno = 0;
+            long const num = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || num < 0 || num > INT_MAX || *endptr) {
+                if (fputs("Invalid fd.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            usagefd = (int)num;
+            break;
+        }
+        case 'T': {
+            char *endptr;
+            errno = 0;
+            cache.ttl = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || cache.ttl < 0 ||
+                cache.ttl > CACHE_MAXTTL || *endptr) {
+                if (fputs("Invalid ttl.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            ttlflag = true;
+            break;
+        }
+        case 'V':
+            cache.names[cache.nnames++] = optarg;
+            break;
         default:
             usage();
             return 2;
         }
     }
 
-    char **const condition = &argv[optind];
-    char **const chain = getblock(condition);
-    if (!chain) {
-        usage();
+    if (!cachepath && (ttlflag || cache.nnames)) {
+        if (fputs("-T and -V can only be used with -C.\n", stderr) == EOF)
+            perror("fputs");
         return 2;
     }
+
+    struct condition *const conds = calloc(count, sizeof *conds);
+    if (!conds) {
+        perror("calloc");
+        return 2;
+    }
+    char **chain = &argv[optind];
+    for (int i = 0; i < count; ++i) {
+        conds[i].argv = chain;
+        conds[i].pidfd = -1;
+        conds[i].pollfd = -1;
+        chain = getblock(chain);
+        if (!chain) {
+            usage();
+            return 2;
+        }
+    }
     char **const cmd = getblock(chain);
     if (!cmd) {
         usage();
         return 2;
     }
 
-    bool dochain = *condition == NULL;
-    unsigned char exitstatus = 0;
-    if (!dochain) {
-        pid_t pid;
-        int const ret = posix_spawnp(&pid, *condition, NULL, NULL,
-                                     condition, environ);
-        if (ret) {
-            perror("posix_spawnp");
+    if (cachepath) {
+        do {
+            cache.fd = open(cachepath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        } while (cache.fd == -1 && errno == EINTR);
+        if (cache.fd == -1) {
+            perror("open");
             return 2;
         }
+    }
 
-        int status;
-        for (;;) {
-            int const ret = waitpid(pid, &status, 0);
-            if (ret != -1)
-                break;
-            if (errno != EINTR) {
-                perror("waitpid");
-                return 2;
-            }
-        }
-        exitstatus = WIFEXITED(status)
-            ? WEXITSTATUS(status)
-            : 128 + WTERMSIG(status);
-        dochain = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    long long const start = now();
+    if (start == -1)
+        return 2;
+    int const status = runconditions(conds, count, orflag, timeout,
+                                     builtinsflag,
+                                     cachepath ? &cache : NULL);
+    if (status == -1)
+        return 2;
+    long long const end = now();
+    if (end == -1 ||
+        !reportusage(conds, count, usagefd, end - start, status, envflag)) {
+        return 2;
     }
+    unsigned char const exitstatus = status;
+    bool const dochain = status == 0;
 
     char *const *const toexec = dochain != negateflag
         ? memmove(&chain[1], chain, (cmd - &chain[1]) * sizeof *chain)
@@ -126,7 +955,7 @@ main(int const argc, char **const argv)
         }
     }
 
-    (void)execvp(*toexec, toexec);
+    (void)trace_execvp(*toexec, toexec);
     perror("execvp");
     return 2;
 }
@@ -1,28 +1,477 @@
-#define _GNU_SOURCE /* memfd_create, MFD_ALLOW_SEALING */
+#define _GNU_SOURCE /* copy_file_range, fallocate, memfd_create, F_SEAL_* */
 #include <errno.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <fcntl.h>
+#include <linux/memfd.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
+#define CHUNK (1 << 20)
+/* below MAX_RW_COUNT, and far enough from overflowing the offsets */
+#define MAXCOPY (1 << 30)
+
+static struct hugeinfo {
+    unsigned flag;
+    char const *string;
+} const hugeinfos[] = {
+#define HUGE(s) { MFD_HUGE_ ## s, #s, }
+    { 0, "default" },
+    HUGE(64KB),
+    HUGE(512KB),
+    HUGE(1MB),
+    HUGE(2MB),
+    HUGE(8MB),
+    HUGE(16MB),
+    HUGE(32MB),
+    HUGE(256MB),
+    HUGE(512MB),
+    HUGE(1GB),
+    HUGE(2GB),
+    HUGE(16GB),
+#undef HUGE
+    { 0, NULL },
+};
+
+static struct sealinfo {
+    int flag;
+    char const *string;
+} const sealinfos[] = {
+#define SEAL(s) { F_SEAL_ ## s, "F_SEAL_" #s, }
+    SEAL(SEAL),
+    SEAL(SHRINK),
+    SEAL(GROW),
+    SEAL(WRITE),
+    SEAL(FUTURE_WRITE),
+    SEAL(EXEC),
+#undef SEAL
+    { 0 },
+};
+
 static void
 usage(void)
 {
     static char const message[] =
-        "Usage: creatememfd [-NS] fd name cmd [args]...\n";
+        "Usage: creatememfd [-eFNpS] [-H pagesize|-i path|-I fd] [-s size] "
+        "[-x SEAL]... fd name cmd [args]...\n"
+        "       creatememfd -n count [-eFNpS] [-H pagesize] [-s size] "
+        "[-x SEAL]... basefd name cmd [args]...\n";
     if (fputs(message, stderr) == EOF)
         perror("fputs");
 }
 
+static bool
+str2huge(char const *const str, unsigned *const flagp)
+{
+    for (struct hugeinfo const *hi = hugeinfos; hi->string; ++hi) {
+        if (strcmp(str, hi->string) == 0) {
+            *flagp = MFD_HUGETLB | hi->flag;
+            return true;
+        }
+    }
+    if (fputs("Invalid page size.\n", stderr) == EOF)
+        perror("fputs");
+    return false;
+}
+
+/* what every memfd gets, be it alone or in a pool */
+struct spec {
+    unsigned flags;
+    off_t size;
+    bool prealloc;
+    bool faultin;
+    int seals;
+};
+
+static bool
+str2seal(char const *const str, int *const sealp)
+{
+    for (struct sealinfo const *si = sealinfos; si->flag; ++si) {
+        if (strcmp(str, si->string) == 0) {
+            *sealp = si->flag;
+            return true;
+        }
+    }
+    if (fputs("Invalid seal.\n", stderr) == EOF)
+        perror("fputs");
+    return false;
+}
+
+static bool
+str2fd(char const *const str, int *const fdp)
+{
+    char *endptr;
+    errno = 0;
+    long const longfd = strtol(str, &endptr, 10);
+    if (errno) {
+        perror("strtol");
+        return false;
+    }
+    if (endptr == str || longfd < 0 || longfd > INT_MAX || *endptr) {
+        if (fputs("Invalid fd.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *fdp = (int)longfd;
+    return true;
+}
+
+/* bytes, with an optional k, m or g suffix for KiB, MiB or GiB */
+static bool
+str2size(char const *const str, off_t *const sizep)
+{
+    char *endptr;
+    errno = 0;
+    long long const num = strtoll(str, &endptr, 10);
+    if (errno) {
+        perror("strtoll");
+        return false;
+    }
+    int shift = 0;
+    switch (*endptr) {
+    case 'g': case 'G':
+        shift += 10;
+        /* fallthrough */
+    case 'm': case 'M':
+        shift += 10;
+        /* fallthrough */
+    case 'k': case 'K':
+        shift += 10;
+        ++endptr;
+    }
+    if (endptr == str || num < 0 || *endptr || num > INT64_MAX >> shift) {
+        if (fputs("Invalid size.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *sizep = (off_t)(num << shift);
+    return true;
+}
+
+static bool
+str2count(char const *const str, int *const countp)
+{
+    char *endptr;
+    errno = 0;
+    long const count = strtol(str, &endptr, 10);
+    if (errno) {
+        perror("strtol");
+        return false;
+    }
+    if (endptr == str || count < 1 || count > INT_MAX || *endptr) {
+        if (fputs("Invalid count.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *countp = (int)count;
+    return true;
+}
+
+/* sets the size, allocating the pages up front with fallocate(2) if asked */
+static bool
+resize(int const memfd, off_t const size, bool const prealloc)
+{
+    int ret;
+    if (prealloc) {
+        do {
+            ret = TRACE("fallocate", fallocate(memfd, 0, 0, size));
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            perror("fallocate");
+            return false;
+        }
+    } else {
+        do {
+            ret = TRACE("ftruncate", ftruncate(memfd, size));
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            perror("ftruncate");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* the pages stay in the memfd after the throwaway mapping goes away */
+static bool
+prefault(int const memfd, off_t const length)
+{
+    void *const map =
+        TRACE("mmap", mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, memfd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    (void)munmap(map, length);
+    return true;
+}
+
+/* whether a failed first in-kernel copy means trying the next method */
+static bool
+unsupported(int const err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * copies src, from its current offset to its end, into memfd; the first
+ * of copy_file_range(2), sendfile(2) and read(2)/write(2) that accepts
+ * the pair of files is used.  Returns the number of bytes copied.
+ */
+static off_t
+fill(int const memfd, int const src)
+{
+    off_t total = 0;
+    for (;;) {
+        ssize_t const ret = TRACE("copy_file_range",
+            copy_file_range(src, NULL, memfd, NULL, MAXCOPY, 0));
+        if (ret == 0)
+            return total;
+        if (ret > 0) {
+            total += ret;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (total == 0 && unsupported(errno))
+            break;
+        perror("copy_file_range");
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t const ret =
+            TRACE("sendfile", sendfile(memfd, src, NULL, MAXCOPY));
+        if (ret == 0)
+            return total;
+        if (ret > 0) {
+            total += ret;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (total == 0 && unsupported(errno))
+            break;
+        perror("sendfile");
+        return -1;
+    }
+
+    char *const buf = malloc(CHUNK);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    for (;;) {
+        ssize_t const nread = TRACE("read", read(src, buf, CHUNK));
+        if (nread == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            free(buf);
+            return -1;
+        }
+        if (nread == 0)
+            break;
+        for (ssize_t off = 0; off < nread;) {
+            ssize_t const nwritten =
+                TRACE("write", write(memfd, &buf[off], nread - off));
+            if (nwritten == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("write");
+                free(buf);
+                return -1;
+            }
+            off += nwritten;
+        }
+        total += nread;
+    }
+    free(buf);
+    return total;
+}
+
+static int
+create(char const *const name, struct spec const *const spec)
+{
+    int const memfd =
+        TRACE("memfd_create", memfd_create(name, spec->flags));
+    if (memfd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (spec->size && !resize(memfd, spec->size, spec->prealloc))
+        return -1;
+    return memfd;
+}
+
+static bool
+finish(int const memfd, off_t const length, struct spec const *const spec)
+{
+    if (spec->faultin && length && !prefault(memfd, length))
+        return false;
+    if (spec->seals &&
+        TRACE("fcntl", fcntl(memfd, F_ADD_SEALS, spec->seals)) == -1) {
+        perror("fcntl(F_ADD_SEALS)");
+        return false;
+    }
+    return true;
+}
+
+static bool
+placefd(int const memfd, int const fd)
+{
+    if (memfd == fd)
+        return true;
+    int ret;
+    do {
+        ret = TRACE("dup2", dup2(memfd, fd));
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("dup2");
+        return false;
+    }
+    do {
+        ret = TRACE("close", close(memfd));
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("close");
+        return false;
+    }
+    return true;
+}
+
+static bool
+exportfds(int const basefd, int const count)
+{
+    char base[10 + 1];
+    char n[10 + 1];
+    if (snprintf(base, sizeof base, "%d", basefd) < 0 ||
+        snprintf(n, sizeof n, "%d", count) < 0) {
+        perror("snprintf");
+        return false;
+    }
+    if (setenv("CREATEMEMFD_BASE", base, 1) == -1 ||
+        setenv("CREATEMEMFD_COUNT", n, 1) == -1) {
+        perror("setenv");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * memfd i ends up on basefd + i, named after template with its first %d
+ * replaced by i; a memfd_create(2) landing on a slot of a later memfd is
+ * harmless, since it is moved out of the way before that slot is filled
+ */
+static int
+do_pool(struct spec const *const spec, int const count, int const basefd,
+        char const *const template, bool const envflag,
+        char *const *const command)
+{
+    if (count - 1 > INT_MAX - basefd) {
+        if (fputs("Too many memfds.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
+    char const *const conv = strstr(template, "%d");
+    for (int i = 0; i < count; ++i) {
+        char name[NAME_MAX + 1];
+        char const *memfdname = template;
+        if (conv) {
+            int const len = snprintf(name, sizeof name, "%.*s%d%s",
+                                     (int)(conv - template), template, i,
+                                     &conv[2]);
+            if (len < 0) {
+                perror("snprintf");
+                return 2;
+            }
+            if ((size_t)len >= sizeof name) {
+                if (fputs("Name too long.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            memfdname = name;
+        }
+
+        int const memfd = create(memfdname, spec);
+        if (memfd == -1 || !finish(memfd, spec->size, spec) ||
+            !placefd(memfd, basefd + i)) {
+            return 2;
+        }
+    }
+
+    if (envflag && !exportfds(basefd, count))
+        return 2;
+
+    (void)trace_execvp(*command, command);
+    perror("execvp");
+    return 2;
+}
+
 int
 main(int const argc, char **const argv)
 {
+    trace_init("creatememfd");
     unsigned memfdflags = MFD_EXEC;
+    unsigned hugeflags = 0;
+    struct spec spec = { 0 };
+    char const *srcpath = NULL;
+    int srcfd = -1;
+    int count = 0;
+    bool envflag = false;
 
-    for (int opt; opt = getopt(argc, argv, "+NS"), opt != -1;) {
+    static char const optstring[] = "+eFH:i:I:n:NpSs:x:";
+    for (int opt; opt = getopt(argc, argv, optstring), opt != -1;) {
         switch (opt) {
+        case 'e':
+            envflag = true;
+            break;
+        case 'F':
+            spec.faultin = true;
+            break;
+        case 'i':
+            srcpath = optarg;
+            srcfd = -1;
+            break;
+        case 'I':
+            if (!str2fd(optarg, &srcfd))
+                return 2;
+            srcpath = NULL;
+            break;
+        case 'x': {
+            int seal;
+            if (!str2seal(optarg, &seal))
+                return 2;
+            spec.seals |= seal;
+            memfdflags |= MFD_ALLOW_SEALING;
+            break;
+        }
+        case 'H':
+            if (!str2huge(optarg, &hugeflags))
+                return 2;
+            break;
+        case 'n':
+            if (!str2count(optarg, &count))
+                return 2;
+            break;
+        case 'p':
+            spec.prealloc = true;
+            break;
+        case 's':
+            if (!str2size(optarg, &spec.size))
+                return 2;
+            break;
         case 'S':
             memfdflags |= MFD_ALLOW_SEALING;
             break;
@@ -36,54 +485,63 @@ main(int const argc, char **const argv)
         }
     }
 
-    if (argc - optind < 3) {
+    if (argc - optind < 3 || (count && (srcpath || srcfd != -1))) {
         usage();
         return 2;
     }
+    /* hugetlbfs takes no write(2), so there is no filling those */
+    if (hugeflags && (srcpath || srcfd != -1)) {
+        if (fputs("-H cannot be used with -i or -I.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+    spec.flags = memfdflags | hugeflags;
 
     char const *const argfd = argv[optind];
     char const *const name = argv[optind + 1];
     char *const *const command = &argv[optind + 2];
 
-    char *endptr;
-    errno = 0;
-    long const longfd = strtol(argfd, &endptr, 10);
-    if (errno) {
-        perror("strtol");
+    int fd;
+    if (!str2fd(argfd, &fd))
         return 2;
-    }
-    if (endptr == argfd || longfd < 0 || longfd > INT_MAX || *endptr) {
-        if (fputs("Invalid fd.\n", stderr) == EOF)
-            perror("fputs");
-        return 2;
-    }
-    int const fd = (int)longfd;
 
-    int const memfd = memfd_create(name, memfdflags);
-    if (memfd == -1) {
-        perror("memfd_create");
+    if (count)
+        return do_pool(&spec, count, fd, name, envflag, command);
+
+    int const memfd = create(name, &spec);
+    if (memfd == -1)
         return 2;
-    }
 
-    if (memfd != fd) {
-        int ret;
-        do {
-            ret = dup2(memfd, fd);
-        } while (ret == -1 && errno == EINTR);
-        if (ret == -1) {
-            perror("dup2");
+    off_t length = spec.size;
+    if (srcpath || srcfd != -1) {
+        int const src = srcpath
+            ? TRACE("open", open(srcpath, O_RDONLY | O_CLOEXEC))
+            : srcfd;
+        if (src == -1) {
+            perror("open");
             return 2;
         }
-        do {
-            ret = close(memfd);
-        } while (ret == -1 && errno == EINTR);
-        if (ret == -1) {
-            perror("close");
+        off_t const filled = fill(memfd, src);
+        if (filled == -1)
+            return 2;
+        if (srcpath)
+            (void)close(src);
+        /* the offset is shared with cmd, which reads from the start */
+        if (TRACE("lseek", lseek(memfd, 0, SEEK_SET)) == -1) {
+            perror("lseek");
             return 2;
         }
+        if (filled > length)
+            length = filled;
     }
 
-    (void)execvp(*command, command);
+    if (!finish(memfd, length, &spec) || !placefd(memfd, fd))
+        return 2;
+
+    if (envflag && !exportfds(fd, 1))
+        return 2;
+
+    (void)trace_execvp(*command, command);
     perror("execvp");
     return 2;
 }
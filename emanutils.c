@@ -0,0 +1,243 @@
+#define _GNU_SOURCE /* strchrnul */
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* every utility is compiled with -Dmain=NAME_main and linked in here */
+#define UTILS \
+    UTIL(chainif) \
+    UTIL(creatememfd) \
+    UTIL(fdcmp) \
+    UTIL(fdprefault) \
+    UTIL(fdseal) \
+    UTIL(fdtruncate) \
+    UTIL(mergeeet) \
+    UTIL(openpathfd) \
+    UTIL(openpidfd) \
+    UTIL(pidfdgetfd) \
+    UTIL(pollinfd) \
+    UTIL(psendfd) \
+    UTIL(ptytty) \
+    UTIL(secretmemfd) \
+
+#define UTIL(name) int name##_main(int, char **);
+UTILS
+#undef UTIL
+
+static struct util {
+    char const *name;
+    int (*main)(int, char **);
+} const utils[] = {
+#define UTIL(name) { #name, name##_main },
+    UTILS
+#undef UTIL
+};
+
+static jmp_buf reenter;
+static int nextargc;
+static char **nextargv;
+
+static void
+usage(void)
+{
+    static char const message[] =
+        "Usage: emanutils util [args]...\n"
+        "Set EMANUTILS_INPROCESS=1 to run chained utils without an exec.\n"
+        "Utils:";
+    if (fputs(message, stderr) == EOF) {
+        perror("fputs");
+        return;
+    }
+    for (size_t i = 0; i < sizeof utils / sizeof *utils; ++i) {
+        if (fprintf(stderr, " %s", utils[i].name) < 0) {
+            perror("fprintf");
+            return;
+        }
+    }
+    if (fputc('\n', stderr) == EOF)
+        perror("fputc");
+}
+
+static struct util const *
+lookup(char const *const path)
+{
+    char const *const slash = strrchr(path, '/');
+    char const *const name = slash ? slash + 1 : path;
+    for (size_t i = 0; i < sizeof utils / sizeof *utils; ++i) {
+        if (strcmp(utils[i].name, name) == 0)
+            return &utils[i];
+    }
+    return NULL;
+}
+
+static bool
+sameinode(struct stat const *const a, struct stat const *const b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/* true if execvp(file) would run this very binary again */
+static bool
+isself(char const *const file)
+{
+    static struct stat self;
+    static int selfstat = -1;
+    if (selfstat == -1) {
+        if (stat("/proc/self/exe", &self) == -1)
+            return false;
+        selfstat = 0;
+    }
+
+    struct stat st;
+    if (strchr(file, '/'))
+        return stat(file, &st) == 0 && sameinode(&st, &self);
+
+    /* same search order as execvp(3): first executable regular file */
+    char const *dirs = getenv("PATH");
+    if (!dirs)
+        dirs = "/bin:/usr/bin";
+    size_t const filelen = strlen(file);
+    for (char const *dir = dirs;; ++dir) {
+        char const *const end = strchrnul(dir, ':');
+        size_t const dirlen = end - dir;
+        char path[PATH_MAX];
+        if (dirlen + filelen + 2 <= sizeof path) {
+            size_t off = 0;
+            if (dirlen) {
+                memcpy(path, dir, dirlen);
+                path[dirlen] = '/';
+                off = dirlen + 1;
+            }
+            memcpy(&path[off], file, filelen + 1);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                access(path, X_OK) == 0) {
+                return sameinode(&st, &self);
+            }
+        }
+        if (!*end)
+            return false;
+        dir = end;
+    }
+}
+
+/* what exec would do to the file descriptor table */
+static int
+closecloexec(void)
+{
+    DIR *const dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    int const self = dirfd(dir);
+    int ret = 0;
+    for (struct dirent *ent; errno = 0, ent = readdir(dir), ent;) {
+        if (*ent->d_name == '.')
+            continue;
+        int const fd = atoi(ent->d_name);
+        if (fd == self)
+            continue;
+        int const flags = fcntl(fd, F_GETFD);
+        if (flags != -1 && (flags & FD_CLOEXEC)) {
+            if (close(fd) == -1 && errno != EINTR) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ret == 0 && errno)
+        ret = -1;
+    int const saved = errno;
+    (void)closedir(dir);
+    errno = saved;
+    return ret;
+}
+
+/*
+ * With EMANUTILS_INPROCESS set to a non-empty value, a utility that runs
+ * another utility of this binary jumps back into main() instead of
+ * exec'ing it.  That is not an exec: stdio is flushed, close-on-exec fds
+ * are closed and getopt(3) is reset, but everything else carries over
+ * to the next utility and the rest of the chain:
+ *
+ *  - signal handlers stay installed, the alternate signal stack stays;
+ *  - the heap, mappings and memory locks are neither freed nor unmapped;
+ *  - threads that are still running keep running;
+ *  - the static state of every utility keeps its last values;
+ *  - atexit(3) and on_exit(3) handlers pile up and all run at the final
+ *    exit (emanutrace.h registers one per utility, which does nothing
+ *    once its utility has exec'd);
+ *  - argv and /proc/PID/comm stay those of the first utility.
+ *
+ * None of the utilities installs signal handlers or leaves threads
+ * behind, but a chain that depends on any of the above must not opt in.
+ * Without the variable, the real execvp(3) is always used.
+ */
+static bool
+inprocess(void)
+{
+    char const *const str = getenv("EMANUTILS_INPROCESS");
+    return str && *str;
+}
+
+/* the utilities call this in place of execvp(3) */
+int
+emanutils_execvp(char const *const file, char *const argv[])
+{
+    if (inprocess() && isself(file)) {
+        if (fflush(NULL) == EOF)
+            return -1;
+        if (closecloexec() == -1)
+            return -1;
+        nextargv = (char **)argv;
+        for (nextargc = 0; argv[nextargc]; ++nextargc)
+            ;
+        longjmp(reenter, 1);
+    }
+    return execvp(file, argv);
+}
+
+static int
+dispatch(int argc, char **argv)
+{
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+
+    struct util const *util = lookup(*argv);
+    if (!util) {
+        if (argc < 2) {
+            usage();
+            return 2;
+        }
+        util = lookup(argv[1]);
+        if (!util) {
+            usage();
+            return 2;
+        }
+        --argc;
+        ++argv;
+    }
+
+    return util->main(argc, argv);
+}
+
+int
+main(int const argc, char **const argv)
+{
+    if (setjmp(reenter)) {
+        /* a fresh program starts with a fresh getopt(3) */
+        optind = 0;
+        opterr = 1;
+        return dispatch(nextargc, nextargv);
+    }
+    return dispatch(argc, argv);
+}
@@ -0,0 +1,172 @@
+/*
+ * Opt-in tracing shared by all the utilities.
+ *
+ * With EMANUTILS_TRACEFD=fd in the environment, every utility appends one
+ * line to fd when it execs the next command or exits:
+ *
+ *   tool=NAME pid=PID ppid=PPID start=NS end=NS exit=STATUS|exec
+ *   [calls=NAME:COUNT:NS:FAILURES,...]
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds; calls aggregates the syscalls
+ * wrapped in TRACE() by name.  The line is written with a single
+ * write(2), so records from concurrent processes do not interleave as
+ * long as fd is a pipe or was opened with O_APPEND.  trace/decode.awk
+ * turns the records back into per-chain timelines.
+ */
+#ifndef EMANUTRACE_H
+#define EMANUTRACE_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#define TRACE_MAXCALLS 16
+
+static struct {
+    int fd;
+    bool registered;
+    bool done;
+    char const *tool;
+    long long start;
+    int ncalls;
+    struct {
+        char const *name;
+        unsigned long count;
+        unsigned long failures;
+        long long ns;
+    } calls[TRACE_MAXCALLS];
+} trace = { .fd = -1 };
+
+static inline long long
+trace_now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void
+trace_write(char const *const outcome)
+{
+    int const saved = errno;
+    char buf[4096];
+    size_t len = 0;
+    int ret = snprintf(buf, sizeof buf,
+                       "tool=%s pid=%ld ppid=%ld start=%lld end=%lld exit=%s",
+                       trace.tool, (long)getpid(), (long)getppid(),
+                       trace.start, trace_now(), outcome);
+    if (ret < 0)
+        goto out;
+    len = (size_t)ret;
+    for (int i = 0; i < trace.ncalls && len < sizeof buf; ++i) {
+        ret = snprintf(&buf[len], sizeof buf - len, "%s%s:%lu:%lld:%lu",
+                       i ? "," : " calls=", trace.calls[i].name,
+                       trace.calls[i].count, trace.calls[i].ns,
+                       trace.calls[i].failures);
+        if (ret < 0)
+            goto out;
+        len += (size_t)ret;
+    }
+    if (len > sizeof buf - 1)
+        len = sizeof buf - 1;
+    buf[len++] = '\n';
+    while (write(trace.fd, buf, len) == -1 && errno == EINTR)
+        ;
+out:
+    errno = saved;
+}
+
+static inline void
+trace_exit(int const status, void *const arg)
+{
+    (void)arg;
+    if (trace.fd == -1 || trace.done)
+        return;
+    char str[3 * sizeof status + 1];
+    (void)snprintf(str, sizeof str, "%d", status);
+    trace_write(str);
+    trace.done = true;
+}
+
+static inline void
+trace_init(char const *const tool)
+{
+    trace.fd = -1;
+    char const *const str = getenv("EMANUTILS_TRACEFD");
+    if (!str || !*str)
+        return;
+    char *endptr;
+    errno = 0;
+    long const fd = strtol(str, &endptr, 10);
+    if (errno || *endptr || fd < 0 || fd > INT_MAX)
+        return;
+
+    trace.tool = tool;
+    trace.start = trace_now();
+    trace.ncalls = 0;
+    trace.done = false;
+    if (!trace.registered) {
+        if (on_exit(trace_exit, NULL) != 0)
+            return;
+        trace.registered = true;
+    }
+    trace.fd = (int)fd;
+}
+
+static inline void
+trace_call(char const *const name, long long const start, bool const failed)
+{
+    long long const ns = trace_now() - start;
+    int i = 0;
+    while (i < trace.ncalls && strcmp(trace.calls[i].name, name))
+        ++i;
+    if (i == trace.ncalls) {
+        if (i == TRACE_MAXCALLS)
+            return;
+        trace.calls[i].name = name;
+        trace.calls[i].count = 0;
+        trace.calls[i].failures = 0;
+        trace.calls[i].ns = 0;
+        ++trace.ncalls;
+    }
+    ++trace.calls[i].count;
+    trace.calls[i].failures += failed;
+    trace.calls[i].ns += ns;
+}
+
+/*
+ * evaluates to call, whose failure is a -1 (or MAP_FAILED) return value,
+ * timing it under name when tracing is enabled; errno is preserved
+ */
+#define TRACE(name, call) __extension__ ({ \
+    long long const trace_start_ = trace.fd == -1 ? 0 : trace_now(); \
+    __typeof__(call) const trace_ret_ = (call); \
+    if (trace.fd != -1) { \
+        int const trace_errno_ = errno; \
+        trace_call(name, trace_start_, (long)trace_ret_ == -1); \
+        errno = trace_errno_; \
+    } \
+    trace_ret_; \
+})
+
+/* the record is written before the exec; a failed exec gets another one */
+static inline int
+trace_execvp(char const *const file, char *const argv[])
+{
+    if (trace.fd != -1) {
+        trace_write("exec");
+        trace.done = true;
+    }
+    int const ret = execvp(file, argv);
+    trace.done = false;
+    return ret;
+}
+
+#endif
@@ -1,13 +1,26 @@
+#define _GNU_SOURCE /* O_CLOEXEC */
 #include <errno.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <linux/kcmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static bool
 str2posint(int *const intp, char const *const str,
            char const *const error)
@@ -28,18 +41,694 @@ str2posint(int *const intp, char const *const str,
     return true;
 }
 
+struct fdref {
+    pid_t pid;
+    int fd;
+};
+
+/* content is compared in chunks of this size, also the read buffer size */
+#define CHUNK ((size_t)1 << 20)
+#define MAXTHREADS 256
+
+struct span {
+    unsigned char const *a;
+    unsigned char const *b;
+    size_t start;
+    size_t end;
+    _Atomic size_t *firstdiff;
+    atomic_bool *truncated;
+};
+
+struct batch {
+    pid_t pid1;
+    pid_t pid2;
+    unsigned accept;
+    bool negate;
+    bool any;
+    bool table;
+    bool env;
+};
+
 static void
 usage(void)
 {
     static char const message[] =
-        "Usage: fdcmp [-0123en] [-p PID1] [-P PID2] fd1 fd2 [cmd]...\n";
+        "Usage: fdcmp [-0123en] [-p PID1] [-P PID2] fd1 fd2 [cmd]...\n"
+        "Usage: fdcmp -c [-en] [-j threads] [-p PID1] [-P PID2] fd1 fd2 "
+        "[cmd]...\n"
+        "Usage: fdcmp -b [-0123enot] [-p PID1] [-P PID2] "
+        "{ [pid1:]fd1 [pid2:]fd2... } [cmd]...\n"
+        "Usage: fdcmp -i fd [-0123enot] [-p PID1] [-P PID2] [cmd]...\n"
+        "Usage: fdcmp -s [-a] pid...\n"
+        "-c reads what is not a regular file from its current offset, "
+        "consuming it.\n";
     if (fputs(message, stderr) == EOF)
         perror("fputs");
 }
 
+static bool
+listfds(pid_t const pid, struct fdref **const refsp, size_t *const np,
+        size_t *const sizep)
+{
+    char path[sizeof "/proc//fd" + 10];
+    int const sz = snprintf(path, sizeof path, "/proc/%d/fd", pid);
+    if (sz < 0 || (size_t)sz >= sizeof path) {
+        perror("snprintf");
+        return false;
+    }
+    DIR *const dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return false;
+    }
+
+    /* our own directory fd would be gone by the time it is compared */
+    int const selffd = pid == getpid() ? dirfd(dir) : -1;
+    for (struct dirent *de; errno = 0, de = readdir(dir);) {
+        if (de->d_name[0] == '.')
+            continue;
+        int const fd = strtol(de->d_name, NULL, 10);
+        if (fd == selffd)
+            continue;
+        if (*np == *sizep) {
+            size_t const size = *sizep ? *sizep * 2 : 64;
+            struct fdref *const newrefs =
+                realloc(*refsp, size * sizeof **refsp);
+            if (!newrefs) {
+                perror("realloc");
+                (void)closedir(dir);
+                return false;
+            }
+            *refsp = newrefs;
+            *sizep = size;
+        }
+        (*refsp)[*np].pid = pid;
+        (*refsp)[(*np)++].fd = fd;
+    }
+    if (errno) {
+        perror("readdir");
+        (void)closedir(dir);
+        return false;
+    }
+    (void)closedir(dir);
+    return true;
+}
+
+/* first kcmp(2) error seen while sorting */
+static int scanerrno;
+
+/*
+ * kcmp(KCMP_FILE) orders open file descriptions totally, so it can sort
+ * them; fds that cannot be compared are dropped before sorting, see
+ * comparable().  One closed during the sort still fails the comparison;
+ * that is recorded, and sortrefs() copes with the order it breaks.
+ */
+static int
+comparfdref(struct fdref const *const x, struct fdref const *const y)
+{
+    switch (TRACE("kcmp", syscall(SYS_kcmp, x->pid, y->pid, KCMP_FILE,
+                                  x->fd, y->fd))) {
+    case 0:
+        return 0;
+    case 1:
+        return -1;
+    case 2:
+        return 1;
+    }
+    if (!scanerrno)
+        scanerrno = errno;
+    return 1;
+}
+
+/* drops, in place, the refs kcmp(2) fails on: closed fds, dead pids */
+static size_t
+comparable(struct fdref *const refs, size_t const n)
+{
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (TRACE("kcmp", syscall(SYS_kcmp, refs[i].pid, refs[i].pid,
+                                  KCMP_FILE, refs[i].fd,
+                                  refs[i].fd)) == -1) {
+            if (!scanerrno)
+                scanerrno = errno;
+            continue;
+        }
+        refs[m++] = refs[i];
+    }
+    return m;
+}
+
+/*
+ * a bottom-up merge sort; unlike qsort(3) it stays within its arrays even
+ * if the comparisons contradict each other
+ */
+static bool
+sortrefs(struct fdref *refs, size_t const n)
+{
+    struct fdref *tmp = malloc(n * sizeof *tmp);
+    if (!tmp && n) {
+        perror("malloc");
+        return false;
+    }
+    struct fdref *const orig = refs;
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t const mid = n - lo > width ? lo + width : n;
+            size_t const hi = n - mid > width ? mid + width : n;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                tmp[k++] = comparfdref(&refs[j], &refs[i]) < 0 ? refs[j++]
+                                                              : refs[i++];
+            }
+            while (i < mid)
+                tmp[k++] = refs[i++];
+            while (j < hi)
+                tmp[k++] = refs[j++];
+        }
+        struct fdref *const t = refs;
+        refs = tmp;
+        tmp = t;
+    }
+    if (refs != orig) {
+        (void)memcpy(orig, refs, n * sizeof *orig);
+        tmp = refs;
+    }
+    free(tmp);
+    return true;
+}
+
+static int
+do_scan(int const argc, char *const *const argv, bool const allflag)
+{
+    struct fdref *refs = NULL;
+    size_t n = 0;
+    size_t size = 0;
+    for (int i = 0; i < argc; ++i) {
+        int pid;
+        if (!str2posint(&pid, argv[i], "Invalid pid.\n"))
+            return 2;
+        /* a pid given twice would share every fd with itself */
+        int j = 0;
+        while (j < i && strtol(argv[j], NULL, 10) != pid)
+            ++j;
+        if (j < i)
+            continue;
+        if (!listfds((pid_t)pid, &refs, &n, &size))
+            return 2;
+    }
+
+    n = comparable(refs, n);
+    if (!sortrefs(refs, n))
+        return 2;
+
+    bool found = false;
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && comparfdref(&refs[i], &refs[j]) == 0; ++j)
+            ;
+        if (j - i < 2 && !allflag)
+            continue;
+        found |= j - i >= 2;
+        for (size_t k = i; k < j; ++k) {
+            char const *const sep = k + 1 < j ? " " : "\n";
+            if (printf("%d:%d%s", refs[k].pid, refs[k].fd, sep) < 0) {
+                perror("printf");
+                return 2;
+            }
+        }
+    }
+    if (fflush(stdout) == EOF) {
+        perror("fflush");
+        return 2;
+    }
+
+    switch (scanerrno) {
+    case 0:
+        break;
+    case EBADF:
+    case ESRCH:
+        if (fputs("fdcmp: some fds went away during the scan.\n",
+                  stderr) == EOF) {
+            perror("fputs");
+        }
+        break;
+    default:
+        errno = scanerrno;
+        perror("kcmp");
+        return 2;
+    }
+    return found ? 0 : 1;
+}
+
+static void
+lowerto(_Atomic size_t *const p, size_t const value)
+{
+    size_t cur = atomic_load_explicit(p, memory_order_relaxed);
+    while (value < cur &&
+           !atomic_compare_exchange_weak_explicit(p, &cur, value,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+        ;
+    }
+}
+
+/*
+ * a file truncated under its mapping raises SIGBUS on the lost pages; the
+ * thread that touched them jumps back out of comparespan()
+ */
+static _Thread_local sigjmp_buf *busjmp;
+
+static void
+onbus(int const sig)
+{
+    if (busjmp)
+        siglongjmp(*busjmp, 1);
+    /* not from a mapping being compared: die of it as usual */
+    (void)signal(sig, SIG_DFL);
+    (void)raise(sig);
+}
+
+/* memcmp(3) is vectorised; only a differing chunk is walked bytewise */
+static void *
+comparespan(void *const arg)
+{
+    struct span const *const s = arg;
+    sigjmp_buf env;
+    if (sigsetjmp(env, 1)) {
+        busjmp = NULL;
+        atomic_store_explicit(s->truncated, true, memory_order_relaxed);
+        return NULL;
+    }
+    busjmp = &env;
+    for (size_t off = s->start; off < s->end; off += CHUNK) {
+        /* another thread found an earlier difference, or a truncation */
+        if (atomic_load_explicit(s->firstdiff, memory_order_relaxed) < off ||
+            atomic_load_explicit(s->truncated, memory_order_relaxed))
+            break;
+        size_t const len = s->end - off < CHUNK ? s->end - off : CHUNK;
+        if (memcmp(&s->a[off], &s->b[off], len) == 0)
+            continue;
+        size_t i = off;
+        while (s->a[i] == s->b[i])
+            ++i;
+        lowerto(s->firstdiff, i);
+        break;
+    }
+    busjmp = NULL;
+    return NULL;
+}
+
+/*
+ * the offset of the first difference, SIZE_MAX if there is none; sets
+ * *truncatedp instead if either file lost mapped pages meanwhile
+ */
+static size_t
+comparemapped(unsigned char const *const a, unsigned char const *const b,
+              size_t const len, long threads, bool *const truncatedp)
+{
+    _Atomic size_t firstdiff = SIZE_MAX;
+    atomic_bool truncated = false;
+    size_t const nchunks = (len + CHUNK - 1) / CHUNK;
+    if ((size_t)threads > nchunks)
+        threads = nchunks;
+    size_t const per = (nchunks + threads - 1) / threads * CHUNK;
+
+    struct span spans[MAXTHREADS];
+    pthread_t tids[MAXTHREADS];
+    bool started[MAXTHREADS];
+    for (long i = 0; i < threads; ++i) {
+        size_t const start = i * per;
+        spans[i] = (struct span){
+            .a = a,
+            .b = b,
+            .start = start < len ? start : len,
+            .end = len - start > per && start < len ? start + per : len,
+            .firstdiff = &firstdiff,
+            .truncated = &truncated,
+        };
+        started[i] = i &&
+            pthread_create(&tids[i], NULL, comparespan, &spans[i]) == 0;
+    }
+    for (long i = 0; i < threads; ++i) {
+        if (!started[i])
+            (void)comparespan(&spans[i]);
+    }
+    for (long i = 1; i < threads; ++i) {
+        if (started[i])
+            (void)pthread_join(tids[i], NULL);
+    }
+    *truncatedp = truncated;
+    return firstdiff;
+}
+
+static ssize_t
+fullread(int const fd, unsigned char *const buf, size_t const size,
+         off_t const offset)
+{
+    size_t n = 0;
+    while (n < size) {
+        ssize_t const ret = offset < 0
+            ? TRACE("read", read(fd, &buf[n], size - n))
+            : TRACE("pread", pread(fd, &buf[n], size - n, offset + n));
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!ret)
+            break;
+        n += ret;
+    }
+    return n;
+}
+
+/*
+ * for what cannot be mapped; regular files are read from the start like
+ * the mapped ones, anything else from its current offset
+ */
+static bool
+compareread(int const fd1, int const fd2, bool const regular,
+            size_t *const diffp)
+{
+    unsigned char *const buf = malloc(2 * CHUNK);
+    if (!buf) {
+        perror("malloc");
+        return false;
+    }
+    bool ret = false;
+    for (size_t off = 0;;) {
+        off_t const at = regular ? (off_t)off : -1;
+        ssize_t const n1 = fullread(fd1, buf, CHUNK, at);
+        ssize_t const n2 = n1 == -1 ? -1 : fullread(fd2, &buf[CHUNK], CHUNK,
+                                                    at);
+        if (n2 == -1) {
+            perror("read");
+            break;
+        }
+        size_t const n = n1 < n2 ? n1 : n2;
+        if (memcmp(buf, &buf[CHUNK], n)) {
+            size_t i = 0;
+            while (buf[i] == buf[CHUNK + i])
+                ++i;
+            *diffp = off + i;
+            ret = true;
+            break;
+        }
+        if (n1 != n2) {
+            *diffp = off + n;
+            ret = true;
+            break;
+        }
+        if (!n1) {
+            *diffp = SIZE_MAX;
+            ret = true;
+            break;
+        }
+        off += n;
+    }
+    free(buf);
+    return ret;
+}
+
+static int
+openfd(pid_t const pid, int const fd)
+{
+    if (pid == getpid())
+        return fd;
+    char path[sizeof "/proc//fd/" + 10 + 10];
+    int const sz = snprintf(path, sizeof path, "/proc/%d/fd/%d", pid, fd);
+    if (sz < 0 || (size_t)sz >= sizeof path) {
+        perror("snprintf");
+        return -1;
+    }
+    int ret;
+    do {
+        ret = TRACE("open", open(path, O_RDONLY | O_CLOEXEC));
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        perror("open");
+    return ret;
+}
+
+/*
+ * sets *diffp to the offset of the first differing byte, or SIZE_MAX if
+ * the contents are the same; unless exact, files of different sizes are
+ * told apart without finding where
+ */
+static bool
+do_content(pid_t const pid1, int fd1, pid_t const pid2, int fd2,
+           long const threads, bool const exact, size_t *const diffp)
+{
+    *diffp = SIZE_MAX;
+    if (TRACE("kcmp", syscall(SYS_kcmp, pid1, pid2, KCMP_FILE,
+                              fd1, fd2)) == 0) {
+        return true;
+    }
+
+    fd1 = openfd(pid1, fd1);
+    if (fd1 == -1)
+        return false;
+    fd2 = openfd(pid2, fd2);
+    if (fd2 == -1)
+        return false;
+
+    struct stat st1, st2;
+    if (fstat(fd1, &st1) == -1 || fstat(fd2, &st2) == -1) {
+        perror("fstat");
+        return false;
+    }
+    bool const regular = S_ISREG(st1.st_mode) && S_ISREG(st2.st_mode);
+    if (!regular)
+        return compareread(fd1, fd2, false, diffp);
+
+    if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+        return true;
+    size_t const len = st1.st_size < st2.st_size ? st1.st_size : st2.st_size;
+    if (st1.st_size != st2.st_size && (!exact || !len)) {
+        *diffp = len;
+        return true;
+    }
+    if (!len)
+        return true;
+
+    unsigned char *const a = TRACE("mmap", mmap(NULL, len, PROT_READ,
+                                                MAP_PRIVATE, fd1, 0));
+    unsigned char *const b = a == MAP_FAILED
+        ? MAP_FAILED
+        : TRACE("mmap", mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd2, 0));
+    if (b == MAP_FAILED) {
+        if (a != MAP_FAILED)
+            (void)munmap(a, len);
+        return compareread(fd1, fd2, true, diffp);
+    }
+    (void)madvise(a, len, MADV_SEQUENTIAL);
+    (void)madvise(b, len, MADV_SEQUENTIAL);
+
+    struct sigaction const sa = { .sa_handler = onbus };
+    struct sigaction oldsa;
+    if (TRACE("sigaction", sigaction(SIGBUS, &sa, &oldsa)) == -1) {
+        perror("sigaction");
+        (void)munmap(a, len);
+        (void)munmap(b, len);
+        return false;
+    }
+    bool truncated;
+    *diffp = comparemapped(a, b, len, threads, &truncated);
+    (void)TRACE("sigaction", sigaction(SIGBUS, &oldsa, NULL));
+    (void)munmap(a, len);
+    (void)munmap(b, len);
+    /* what is left of the files is read instead */
+    if (truncated)
+        return compareread(fd1, fd2, true, diffp);
+    if (*diffp == SIZE_MAX && st1.st_size != st2.st_size)
+        *diffp = len;
+    return true;
+}
+
+static char **
+getblock(char **const args)
+{
+    if (!*args)
+        return NULL;
+    if (!**args) {
+        *args = NULL;
+        return &args[1];
+    }
+    if (**args != ' ')
+        return NULL;
+    ++*args;
+    return getblock(&args[1]);
+}
+
+/* all of fd, split on whitespace */
+static char **
+readpairs(int const fd)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    size_t size = 0;
+    for (;;) {
+        if (size - len < 4096) {
+            size = size ? size * 2 : 8192;
+            char *const newbuf = realloc(buf, size);
+            if (!newbuf) {
+                perror("realloc");
+                return NULL;
+            }
+            buf = newbuf;
+        }
+        ssize_t const n = TRACE("read", read(fd, &buf[len], size - len - 1));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return NULL;
+        }
+        if (!n)
+            break;
+        len += n;
+    }
+    buf[len] = '\0';
+
+    size_t ntokens = 0;
+    char **tokens = malloc(sizeof *tokens);
+    if (!tokens) {
+        perror("malloc");
+        return NULL;
+    }
+    static char const spaces[] = " \t\n";
+    for (char *save, *tok = strtok_r(buf, spaces, &save); tok;
+         tok = strtok_r(NULL, spaces, &save)) {
+        char **const newtokens =
+            realloc(tokens, (ntokens + 2) * sizeof *tokens);
+        if (!newtokens) {
+            perror("realloc");
+            return NULL;
+        }
+        tokens = newtokens;
+        tokens[ntokens++] = tok;
+    }
+    tokens[ntokens] = NULL;
+    return tokens;
+}
+
+static bool
+str2ref(char const *const str, pid_t const defpid, struct fdref *const ref)
+{
+    char const *const colon = strchr(str, ':');
+    if (!colon) {
+        ref->pid = defpid;
+        return str2posint(&ref->fd, str, "Invalid fd.\n");
+    }
+    char pidstr[10 + 1];
+    size_t const len = colon - str;
+    if (len >= sizeof pidstr) {
+        if (fputs("Invalid pid.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    memcpy(pidstr, str, len);
+    pidstr[len] = '\0';
+    int pid;
+    if (!str2posint(&pid, pidstr, "Invalid pid.\n"))
+        return false;
+    ref->pid = (pid_t)pid;
+    return str2posint(&ref->fd, &colon[1], "Invalid fd.\n");
+}
+
+/*
+ * one kcmp(2) per pair, all in this process; the kcmp results, one digit
+ * per pair, go to FDCMP_KCMP with -e
+ */
+static int
+do_batch(struct batch const *const b, char const *const inputfd_str,
+         char **const args)
+{
+    char **pairs;
+    char **cmd;
+    if (inputfd_str) {
+        int inputfd;
+        if (!str2posint(&inputfd, inputfd_str, "Invalid input fd.\n"))
+            return 2;
+        pairs = readpairs(inputfd);
+        if (!pairs)
+            return 2;
+        cmd = args;
+    } else {
+        pairs = args;
+        cmd = getblock(args);
+        if (!cmd) {
+            usage();
+            return 2;
+        }
+    }
+
+    size_t n = 0;
+    while (pairs[n])
+        ++n;
+    if (n % 2) {
+        if (fputs("Odd number of fds.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+    n /= 2;
+
+    char *const results = malloc(n + 1);
+    if (!results) {
+        perror("malloc");
+        return 2;
+    }
+    size_t matches = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct fdref r1, r2;
+        if (!str2ref(pairs[2 * i], b->pid1, &r1) ||
+            !str2ref(pairs[2 * i + 1], b->pid2, &r2)) {
+            return 2;
+        }
+        int const res = TRACE("kcmp", syscall(SYS_kcmp, r1.pid, r2.pid,
+                                              KCMP_FILE, r1.fd, r2.fd));
+        if (res == -1) {
+            static char const efmt[] = "kcmp: %d:%d %d:%d: %s\n";
+            if (fprintf(stderr, efmt, r1.pid, r1.fd, r2.pid, r2.fd,
+                        strerror(errno)) < 0) {
+                perror("fprintf");
+            }
+            return 2;
+        }
+        results[i] = '0' + res;
+        bool const match = !!(b->accept & 1U << res) != b->negate;
+        matches += match;
+        if (b->table && printf("%d:%d %d:%d %d\n", r1.pid, r1.fd, r2.pid,
+                               r2.fd, res) < 0) {
+            perror("printf");
+            return 2;
+        }
+    }
+    results[n] = '\0';
+    if (b->table && fflush(stdout) == EOF) {
+        perror("fflush");
+        return 2;
+    }
+
+    if (b->any ? !matches : matches != n)
+        return 1;
+
+    if (!*cmd)
+        return 0;
+
+    if (b->env && setenv("FDCMP_KCMP", results, 1) == -1) {
+        perror("setenv");
+        return 2;
+    }
+
+    (void)trace_execvp(*cmd, cmd);
+    perror("execvp");
+    return 2;
+}
+
 int
-main(int const argc, char *const *const argv)
+main(int const argc, char **const argv)
 {
+    trace_init("fdcmp");
     char const *pid1_str = NULL;
     char const *pid2_str = NULL;
     bool zeroflag = false;
@@ -48,8 +737,17 @@ main(int const argc, char *const *const argv)
     bool threeflag = false;
     bool envflag = false;
     bool negateflag = false;
+    bool scanflag = false;
+    bool allflag = false;
+    bool contentflag = false;
+    long threads = 1;
+    bool batchflag = false;
+    char const *inputfd_str = NULL;
+    bool anyflag = false;
+    bool tableflag = false;
 
-    for (int opt; opt = getopt(argc, argv, "+0123enp:P:"), opt != -1;) {
+    static char const optstring[] = "+0123abcei:j:nop:P:st";
+    for (int opt; opt = getopt(argc, argv, optstring), opt != -1;) {
         switch (opt) {
         case '0':
             zeroflag = true;
@@ -75,28 +773,59 @@ main(int const argc, char *const *const argv)
         case 'P':
             pid2_str = optarg;
             break;
+        case 'a':
+            allflag = true;
+            break;
+        case 'b':
+            batchflag = true;
+            break;
+        case 'c':
+            contentflag = true;
+            break;
+        case 'i':
+            inputfd_str = optarg;
+            break;
+        case 'o':
+            anyflag = true;
+            break;
+        case 't':
+            tableflag = true;
+            break;
+        case 'j': {
+            char *endptr;
+            errno = 0;
+            threads = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || threads < 1 ||
+                threads > MAXTHREADS) {
+                if (fputs("Invalid threads.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            break;
+        }
+        case 's':
+            scanflag = true;
+            break;
         default:
             usage();
             return 2;
         }
     }
 
-    if (!(oneflag || twoflag || threeflag))
-        zeroflag = true;
-
-    if (optind + 2 > argc) {
-        usage();
-        return 2;
+    if (scanflag) {
+        if (optind == argc) {
+            usage();
+            return 2;
+        }
+        return do_scan(argc - optind, &argv[optind], allflag);
     }
 
-    int fd1;
-    int fd2;
-    if (!str2posint(&fd1, argv[optind], "Invalid fd1.\n") ||
-        !str2posint(&fd2, argv[optind + 1], "Invalid fd2.\n")) {
+    if (contentflag && (zeroflag || oneflag || twoflag || threeflag)) {
+        usage();
         return 2;
     }
-
-    char *const *const cmd = &argv[optind + 2];
+    if (!(oneflag || twoflag || threeflag))
+        zeroflag = true;
 
     pid_t pid1;
     if (pid1_str) {
@@ -117,8 +846,56 @@ main(int const argc, char *const *const argv)
         pid2 = pid1;
     }
 
-    int const res = syscall(SYS_kcmp, pid1, pid2, KCMP_FILE, fd1, fd2);
+    if (batchflag || inputfd_str) {
+        if (contentflag || (batchflag && inputfd_str)) {
+            usage();
+            return 2;
+        }
+        struct batch b = {
+            .pid1 = pid1,
+            .pid2 = pid2,
+            .accept = zeroflag | oneflag << 1 | twoflag << 2 |
+                      threeflag << 3,
+            .negate = negateflag,
+            .any = anyflag,
+            .table = tableflag,
+            .env = envflag,
+        };
+        return do_batch(&b, inputfd_str, &argv[optind]);
+    }
+
+    if (optind + 2 > argc) {
+        usage();
+        return 2;
+    }
+
+    int fd1;
+    int fd2;
+    if (!str2posint(&fd1, argv[optind], "Invalid fd1.\n") ||
+        !str2posint(&fd2, argv[optind + 1], "Invalid fd2.\n")) {
+        return 2;
+    }
+
+    char *const *const cmd = &argv[optind + 2];
+
+    char const *env = "FDCMP_KCMP";
     char const *res_str;
+    char diffstr[3 * sizeof (size_t) + 1] = "";
+    if (contentflag) {
+        size_t diff;
+        if (!do_content(pid1, fd1, pid2, fd2, threads, envflag, &diff))
+            return 2;
+        if ((diff == SIZE_MAX) == negateflag)
+            return 1;
+        if (diff != SIZE_MAX)
+            (void)snprintf(diffstr, sizeof diffstr, "%zu", diff);
+        env = "FDCMP_DIFF";
+        res_str = diffstr;
+        goto chain;
+    }
+
+    int const res = TRACE("kcmp", syscall(SYS_kcmp, pid1, pid2, KCMP_FILE,
+                                          fd1, fd2));
     switch (res) {
     case -1:
         perror("kcmp");
@@ -144,15 +921,16 @@ main(int const argc, char *const *const argv)
         res_str = "3";
     }
 
+chain:
     if (*cmd == NULL)
         return 0;
 
-    if (envflag && setenv("FDCMP_KCMP", res_str, 1) == -1) {
+    if (envflag && setenv(env, res_str, 1) == -1) {
         perror("setenv");
         return 2;
     }
 
-    (void)execvp(*cmd, cmd);
+    (void)trace_execvp(*cmd, cmd);
     perror("execvp");
     return 2;
 }
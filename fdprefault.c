@@ -0,0 +1,249 @@
+#define _GNU_SOURCE /* readahead, MADV_POPULATE_READ */
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emanutrace.h"
+
+static void
+usage(void)
+{
+    static char const message[] =
+        "Usage: fdprefault [-eHrw] [-o offset] [-l length] fd [cmd]...\n";
+    if (fputs(message, stderr) == EOF)
+        perror("fputs");
+}
+
+/* bytes, with an optional k, m or g suffix for KiB, MiB or GiB */
+static bool
+str2size(char const *const str, off_t *const sizep)
+{
+    char *endptr;
+    errno = 0;
+    long long const num = strtoll(str, &endptr, 10);
+    if (errno) {
+        perror("strtoll");
+        return false;
+    }
+    int shift = 0;
+    switch (*endptr) {
+    case 'g': case 'G':
+        shift += 10;
+        /* fallthrough */
+    case 'm': case 'M':
+        shift += 10;
+        /* fallthrough */
+    case 'k': case 'K':
+        shift += 10;
+        ++endptr;
+    }
+    if (endptr == str || num < 0 || *endptr || num > INT64_MAX >> shift) {
+        if (fputs("Invalid size.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *sizep = (off_t)(num << shift);
+    return true;
+}
+
+static bool
+resident(void *const map, size_t const length, unsigned char *const vec,
+         size_t const npages, size_t *const countp)
+{
+    if (TRACE("mincore", mincore(map, length, vec)) == -1) {
+        perror("mincore");
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < npages; ++i)
+        count += vec[i] & 1;
+    *countp = count;
+    return true;
+}
+
+/*
+ * mincore(2) reports the page cache only for files the caller owns or may
+ * write to; for others, every page looks resident, so the count of pages
+ * brought in is given as "unknown"
+ */
+static bool
+cachevisible(int const fd, struct stat const *const st)
+{
+    if (st->st_uid == geteuid())
+        return true;
+    char path[sizeof "/proc/self/fd/" + 10];
+    int const sz = snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    if (sz < 0 || (size_t)sz >= sizeof path)
+        return false;
+    return TRACE("faccessat",
+                 faccessat(AT_FDCWD, path, W_OK, AT_EACCESS)) == 0;
+}
+
+int
+main(int const argc, char *const *const argv)
+{
+    trace_init("fdprefault");
+    bool envflag = false;
+    bool hugeflag = false;
+    bool readaheadflag = false;
+    bool willneedflag = false;
+    off_t offset = 0;
+    off_t length = -1;
+    for (int opt; opt = getopt(argc, argv, "+eHl:o:rw"), opt != -1;) {
+        switch (opt) {
+        case 'e':
+            envflag = true;
+            break;
+        case 'H':
+            hugeflag = true;
+            break;
+        case 'l':
+            if (!str2size(optarg, &length))
+                return 2;
+            break;
+        case 'o':
+            if (!str2size(optarg, &offset))
+                return 2;
+            break;
+        case 'r':
+            readaheadflag = true;
+            break;
+        case 'w':
+            willneedflag = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind < 1) {
+        usage();
+        return 2;
+    }
+
+    char *const fdstr = argv[optind];
+    char *endptr;
+    errno = 0;
+    long const longfd = strtol(fdstr, &endptr, 10);
+    if (errno) {
+        perror("strtol");
+        return 2;
+    }
+    if (endptr == fdstr || longfd < 0 || longfd > INT_MAX || *endptr) {
+        if (fputs("Invalid fd.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+    int const fd = (int)longfd;
+    char *const *const command = &argv[optind + 1];
+
+    struct stat st;
+    if (TRACE("fstat", fstat(fd, &st)) == -1) {
+        perror("fstat");
+        return 2;
+    }
+    bool const counted = cachevisible(fd, &st);
+    /* by default, and at most, up to the end of the file */
+    off_t const left = st.st_size > offset ? st.st_size - offset : 0;
+    if (length == -1 || (S_ISREG(st.st_mode) && length > left))
+        length = left;
+
+    /* mmap(2) wants a page-aligned offset */
+    long const pagesize = sysconf(_SC_PAGESIZE);
+    off_t const start = offset - offset % pagesize;
+    if (length > PTRDIFF_MAX - pagesize - (offset - start)) {
+        if (fputs("Invalid length.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+    size_t const maplen = length ? (size_t)(length + (offset - start)) : 0;
+    size_t const npages = (maplen + pagesize - 1) / pagesize;
+
+    /*
+     * -r and -w only start the I/O, populating the mapping waits for it;
+     * either way, what was brought in is told apart from what already
+     * was resident with mincore(2) on the same mapping
+     */
+    size_t pages = 0;
+    if (maplen) {
+        unsigned char *const vec = malloc(npages);
+        if (!vec) {
+            perror("malloc");
+            return 2;
+        }
+        void *const map = TRACE("mmap", mmap(NULL, maplen, PROT_READ,
+                                             MAP_SHARED, fd, start));
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return 2;
+        }
+        size_t before = 0;
+        if (counted && !resident(map, maplen, vec, npages, &before))
+            return 2;
+
+        if (readaheadflag &&
+            TRACE("readahead", readahead(fd, offset, length)) == -1) {
+            perror("readahead");
+            return 2;
+        }
+        if (willneedflag) {
+            int const err = TRACE("posix_fadvise",
+                posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED));
+            if (err) {
+                errno = err;
+                perror("posix_fadvise");
+                return 2;
+            }
+        }
+        if (hugeflag &&
+            TRACE("madvise", madvise(map, maplen, MADV_HUGEPAGE)) == -1) {
+            perror("madvise(MADV_HUGEPAGE)");
+            return 2;
+        }
+        if (!readaheadflag && !willneedflag &&
+            TRACE("madvise",
+                  madvise(map, maplen, MADV_POPULATE_READ)) == -1) {
+            perror("madvise(MADV_POPULATE_READ)");
+            return 2;
+        }
+
+        size_t after = 0;
+        if (counted && !resident(map, maplen, vec, npages, &after))
+            return 2;
+        pages = after > before ? after - before : 0;
+        (void)munmap(map, maplen);
+        free(vec);
+    }
+
+    char buf[3 * sizeof pages + 1] = "unknown";
+    if (counted && snprintf(buf, sizeof buf, "%zu", pages) < 0) {
+        perror("snprintf");
+        return 2;
+    }
+
+    if (!*command) {
+        if (puts(buf) == EOF) {
+            perror("puts");
+            return 2;
+        }
+        return 0;
+    }
+
+    if (envflag && setenv("FDPREFAULT_PAGES", buf, 1) == -1) {
+        perror("setenv");
+        return 2;
+    }
+
+    (void)trace_execvp(*command, command);
+    perror("execvp");
+    return 2;
+}
@@ -9,6 +9,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static struct sealinfo {
     int flag;
     char const *string;
@@ -97,7 +99,7 @@ do_add(int const argc, char **const argv)
     if (fd < 0)
         return 2;
 
-    if (fcntl(fd, F_ADD_SEALS, seals) != 0) {
+    if (TRACE("fcntl", fcntl(fd, F_ADD_SEALS, seals)) != 0) {
         perror("fcntl(F_ADD_SEALS)");
         return 1;
     }
@@ -105,7 +107,7 @@ do_add(int const argc, char **const argv)
     if (!*command)
         return 0;
 
-    (void)execvp(*command, command);
+    (void)trace_execvp(*command, command);
     perror("execvp");
     return 0;
 }
@@ -150,8 +152,8 @@ do_check(int const argc, char **const argv)
     if (fd < 0)
         return 2;
 
-    int fdseals = fcntl(fd, F_GET_SEALS);
-    if (seals == -1) {
+    int fdseals = TRACE("fcntl", fcntl(fd, F_GET_SEALS));
+    if (fdseals == -1) {
         perror("fcntl(F_GET_SEALS)");
         return 2;
     }
@@ -164,7 +166,7 @@ do_check(int const argc, char **const argv)
     if (!*command)
         return 0;
 
-    (void)execvp(*command, command);
+    (void)trace_execvp(*command, command);
     perror("execvp");
     return 0;
 }
@@ -188,7 +190,7 @@ do_get(int const argc, char **const argv)
     if (fd < 0)
         return 2;
 
-    int seals = fcntl(fd, F_GET_SEALS);
+    int seals = TRACE("fcntl", fcntl(fd, F_GET_SEALS));
     if (seals == -1) {
         perror("fcntl(F_GET_SEALS)");
         return 1;
@@ -232,6 +234,7 @@ do_get(int const argc, char **const argv)
 int
 main(int const argc, char **const argv)
 {
+    trace_init("fdseal");
     if (argc > 1) {
         if (strcmp(argv[1], "add") == 0)
             return do_add(argc - 1, &argv[1]);
@@ -6,6 +6,8 @@
 
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static void
 usage(void)
 {
@@ -17,6 +19,7 @@ usage(void)
 int
 main(int const argc, char *const *const argv)
 {
+    trace_init("fdtruncate");
     for (int opt; opt = getopt(argc, argv, "+"), opt != -1;) {
         switch (opt) {
         default:
@@ -61,7 +64,7 @@ main(int const argc, char *const *const argv)
         length = (off_t)longlength;
     }
 
-    while (ftruncate(fd, length) == -1) {
+    while (TRACE("ftruncate", ftruncate(fd, length)) == -1) {
         if (errno != EINTR) {
             perror("ftruncate");
             return 2;
@@ -71,7 +74,7 @@ main(int const argc, char *const *const argv)
     if (argc - optind < 3)
         return 0;
 
-    (void)execvp(argv[optind + 2], &argv[optind + 2]);
+    (void)trace_execvp(argv[optind + 2], &argv[optind + 2]);
     perror("execvp");
     return 2;
 }
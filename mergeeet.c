@@ -7,8 +7,11 @@
 #include <string.h>
 
 #include <poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 struct buffer {
     char *buffer;
     size_t size;
@@ -42,7 +45,7 @@ str2int(char const *const str)
 static ssize_t
 retryeintr_read(int const fd, char *const buf, size_t const size)
 {
-    ssize_t const ret = read(fd, buf, size);
+    ssize_t const ret = TRACE("read", read(fd, buf, size));
     if (ret == -1 && errno == EINTR)
         return retryeintr_read(fd, buf, size);
     return ret;
@@ -51,7 +54,7 @@ retryeintr_read(int const fd, char *const buf, size_t const size)
 static int
 retryeintr_close(int const fd)
 {
-    int const ret = close(fd);
+    int const ret = TRACE("close", close(fd));
     if (ret == -1 && errno == EINTR)
         return retryeintr_close(fd);
     return ret;
@@ -61,7 +64,7 @@ static bool
 fullwrite(int const fd, char const *buf, size_t size)
 {
     for (;;) {
-        int const nwrite = write(fd, buf, size);
+        int const nwrite = TRACE("write", write(fd, buf, size));
         if (nwrite == -1) {
             if (errno == EINTR)
                 continue;
@@ -113,10 +116,38 @@ buffer_clear(struct buffer *const b)
     b->size = b->length = 0;
 }
 
+/* the partial record and what completes it, in a single writev(2) */
 static bool
-buffer_flush(int fd, struct buffer *const b)
+buffer_flush(int const fd, struct buffer *const b, char const *const buf,
+             size_t const size)
 {
-    bool const ret = fullwrite(fd, b->buffer, b->length);
+    struct iovec iov[2] = {
+        { .iov_base = b->buffer, .iov_len = b->length },
+        { .iov_base = (char *)buf, .iov_len = size },
+    };
+    struct iovec *v = b->length ? iov : &iov[1];
+    int n = &iov[2] - v;
+    bool ret = true;
+    while (n) {
+        ssize_t const nwrite = TRACE("writev", writev(fd, v, n));
+        if (nwrite == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            ret = false;
+            break;
+        }
+        size_t left = nwrite;
+        while (n && left >= v->iov_len) {
+            left -= v->iov_len;
+            ++v;
+            --n;
+        }
+        if (n) {
+            v->iov_base = (char *)v->iov_base + left;
+            v->iov_len -= left;
+        }
+    }
     buffer_clear(b);
     return ret;
 }
@@ -132,6 +163,7 @@ comparpollfd(void const *const a, void const *const b)
 int
 main(int const argc, char *const *const argv)
 {
+    trace_init("mergeeet");
     struct buffer *buffers = NULL;
     char delimiter = '\n';
     bool discardpartial = false;
@@ -206,7 +238,7 @@ main(int const argc, char *const *const argv)
     }
 
     for (nfds_t readablefds = nfds;;) {
-        int ret = poll(fds, nfds, -1);
+        int ret = TRACE("poll", poll(fds, nfds, -1));
         if (ret < 0) {
             if (errno == EINTR || errno == EAGAIN)
                 continue;
@@ -242,8 +274,8 @@ main(int const argc, char *const *const argv)
                     char *const del = memrchr(buf, delimiter, nread);
                     size_t len = del - buf + 1;
                     if (del) {
-                        if (!buffer_flush(STDOUT_FILENO, &buffers[i]) ||
-                            !fullwrite(STDOUT_FILENO, buf, len)) {
+                        if (!buffer_flush(STDOUT_FILENO, &buffers[i], buf,
+                                          len)) {
                             exitstatus = 2;
                             goto done;
                         }
@@ -264,8 +296,8 @@ pollhup:
                     if (discardpartial) {
                         buffer_clear(&buffers[i]);
                     } else {
-                        if (!buffer_flush(STDOUT_FILENO, &buffers[i]) ||
-                            !fullwrite(STDOUT_FILENO, &delimiter, 1)) {
+                        if (!buffer_flush(STDOUT_FILENO, &buffers[i],
+                                          &delimiter, 1)) {
                             exitstatus = 2;
                             goto done;
                         }
@@ -8,6 +8,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static void
 usage(void)
 {
@@ -20,6 +22,7 @@ usage(void)
 int
 main(int const argc, char *const *const argv)
 {
+    trace_init("openpathfd");
     int openflags = O_PATH | O_NOFOLLOW;
     for (int opt; opt = getopt(argc, argv, "+dL"), opt != -1;) {
         switch (opt) {
@@ -60,7 +63,7 @@ main(int const argc, char *const *const argv)
 
     int openfd;
     do {
-        openfd = open(path, openflags);
+        openfd = TRACE("open", open(path, openflags));
     } while (openfd == -1 && errno == EINTR);
     if (openfd == -1) {
         perror("open");
@@ -70,14 +73,14 @@ main(int const argc, char *const *const argv)
     if (openfd != fd) {
         int ret;
         do {
-            ret = dup2(openfd, fd);
+            ret = TRACE("dup2", dup2(openfd, fd));
         } while (ret == -1 && errno == EINTR);
         if (ret == -1) {
             perror("dup2");
             return 2;
         }
         do {
-            ret = close(openfd);
+            ret = TRACE("close", close(openfd));
         } while (ret == -1 && errno == EINTR);
         if (ret == -1) {
             perror("close");
@@ -85,7 +88,7 @@ main(int const argc, char *const *const argv)
         }
     }
 
-    (void)execvp(*command, command);
+    (void)trace_execvp(*command, command);
     perror("execvp");
     return 2;
 }
@@ -1,83 +1,361 @@
+#include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
+/* named: given with -l, so it must not have exited */
+struct pident {
+    pid_t pid;
+    bool named;
+};
+
+struct pids {
+    struct pident *pids;
+    size_t n;
+    size_t size;
+};
+
 static void
 usage(void)
 {
-    static char const msg[] = "Usage: openpidfd fd pid cmd [args]...\n";
+    static char const msg[] =
+        "Usage: openpidfd [-e] fd pid cmd [args]...\n"
+        "Usage: openpidfd [-e] -c pid|-g cgroup|-l pid[,pid]... basefd "
+        "cmd [args]...\n";
     if (fputs(msg, stderr) == EOF)
         perror("fputs");
 }
 
+static bool
+str2num(char const *const str, char **const endptrp, int *const out)
+{
+    char *endptr;
+    errno = 0;
+    long const num = strtol(str, &endptr, 10);
+    if (errno) {
+        perror("strtol");
+        return false;
+    }
+    if (endptr == str || num < 0 || num > INT_MAX || (!endptrp && *endptr)) {
+        if (fputs("Invalid argument.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    if (endptrp)
+        *endptrp = endptr;
+    *out = (int)num;
+    return true;
+}
+
+static int
+comparpid(void const *const a, void const *const b)
+{
+    pid_t const pa = ((struct pident const *)a)->pid;
+    pid_t const pb = ((struct pident const *)b)->pid;
+    return (pa > pb) - (pa < pb);
+}
+
+static bool
+pids_add(struct pids *const p, pid_t const pid, bool const named)
+{
+    if (p->n == p->size) {
+        size_t const newsize = p->size ? p->size * 2 : 16;
+        struct pident *const newpids =
+            realloc(p->pids, newsize * sizeof *newpids);
+        if (!newpids) {
+            perror("realloc");
+            return false;
+        }
+        p->pids = newpids;
+        p->size = newsize;
+    }
+    p->pids[p->n++] = (struct pident){ pid, named };
+    return true;
+}
+
+static bool
+pids_fromfile(struct pids *const p, char const *const path)
+{
+    FILE *const fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen");
+        return false;
+    }
+    for (int pid; fscanf(fp, "%d", &pid) == 1;) {
+        /* cgroup.procs lists processes of other pid namespaces as 0 */
+        if (pid == 0)
+            continue;
+        if (!pids_add(p, pid, false)) {
+            (void)fclose(fp);
+            return false;
+        }
+    }
+    bool const ret = !ferror(fp);
+    if (!ret)
+        perror("fscanf");
+    (void)fclose(fp);
+    return ret;
+}
+
+static bool
+pids_fromcgroup(struct pids *const p, char const *const cgroup)
+{
+    size_t const len = strlen(cgroup);
+    char *const path = malloc(len + sizeof "/cgroup.procs");
+    if (!path) {
+        perror("malloc");
+        return false;
+    }
+    (void)memcpy(path, cgroup, len);
+    (void)memcpy(&path[len], "/cgroup.procs", sizeof "/cgroup.procs");
+    bool const ret = pids_fromfile(p, path);
+    free(path);
+    return ret;
+}
+
+static bool
+pids_fromchildren(struct pids *const p, pid_t const pid)
+{
+    char path[sizeof "/proc//task//children" + 10 + 10];
+    int sz = snprintf(path, sizeof path, "/proc/%d/task", pid);
+    if (sz < 0 || (size_t)sz >= sizeof path) {
+        perror("snprintf");
+        return false;
+    }
+    DIR *const dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return false;
+    }
+    for (struct dirent *de; errno = 0, de = readdir(dir);) {
+        if (de->d_name[0] == '.')
+            continue;
+        sz = snprintf(path, sizeof path, "/proc/%d/task/%s/children", pid,
+                      de->d_name);
+        if (sz < 0 || (size_t)sz >= sizeof path) {
+            perror("snprintf");
+            (void)closedir(dir);
+            return false;
+        }
+        if (!pids_fromfile(p, path)) {
+            (void)closedir(dir);
+            return false;
+        }
+    }
+    bool const ret = !errno;
+    if (!ret)
+        perror("readdir");
+    (void)closedir(dir);
+    return ret;
+}
+
+static bool
+pids_fromlist(struct pids *const p, char const *str)
+{
+    for (;;) {
+        char *endptr;
+        int pid;
+        if (!str2num(str, &endptr, &pid))
+            return false;
+        if (*endptr && *endptr != ',') {
+            if (fputs("Invalid argument.\n", stderr) == EOF)
+                perror("fputs");
+            return false;
+        }
+        if (!pids_add(p, pid, true))
+            return false;
+        if (!*endptr)
+            return true;
+        str = &endptr[1];
+    }
+}
+
+/* pidfds are always close-on-exec, so F_SETFD needs no F_GETFD first */
+static bool
+placefd(int const pidfd, int const fd)
+{
+    if (pidfd != fd) {
+        int ret;
+        do {
+            ret = TRACE("dup2", dup2(pidfd, fd));
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            perror("dup2");
+            return false;
+        }
+    } else if (TRACE("fcntl", fcntl(fd, F_SETFD, 0)) == -1) {
+        perror("fcntl(F_SETFD)");
+        return false;
+    }
+    return true;
+}
+
+static int
+do_bulk(struct pids *const p, int const basefd, bool const envflag,
+        char *const *const cmd)
+{
+    qsort(p->pids, p->n, sizeof *p->pids, comparpid);
+    size_t n = 0;
+    for (size_t i = 0; i < p->n; ++i) {
+        if (n && p->pids[i].pid == p->pids[n - 1].pid)
+            p->pids[n - 1].named |= p->pids[i].named;
+        else
+            p->pids[n++] = p->pids[i];
+    }
+    if (n > (size_t)(INT_MAX - basefd)) {
+        if (fputs("Too many processes.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
+    char *map = NULL;
+    size_t maplen = 0;
+    if (envflag) {
+        map = malloc(n * (10 + 1 + 10 + 1) + 1);
+        if (!map) {
+            perror("malloc");
+            return 2;
+        }
+        map[0] = '\0';
+    }
+
+    int nextfd = basefd;
+    for (size_t i = 0; i < n; ++i) {
+        int const pidfd = TRACE("pidfd_open",
+                                syscall(SYS_pidfd_open, p->pids[i].pid, 0));
+        if (pidfd == -1) {
+            if (!p->pids[i].named && errno == ESRCH)
+                continue;
+            perror("pidfd_open");
+            return 2;
+        }
+        if (!placefd(pidfd, nextfd))
+            return 2;
+        if (pidfd != nextfd && close(pidfd) == -1 && errno != EINTR) {
+            perror("close");
+            return 2;
+        }
+
+        if (envflag) {
+            int const sz = sprintf(&map[maplen], &",%d:%d"[!maplen],
+                                   p->pids[i].pid, nextfd);
+            if (sz < 0) {
+                perror("sprintf");
+                return 2;
+            }
+            maplen += sz;
+        }
+        ++nextfd;
+    }
+
+    if (envflag) {
+        char buf[10 + 1];
+        int const sz = snprintf(buf, sizeof buf, "%d", nextfd - basefd);
+        if (sz < 0) {
+            perror("snprintf");
+            return 2;
+        }
+        if (setenv("OPENPIDFD_COUNT", buf, 1) == -1 ||
+            setenv("OPENPIDFD_FDS", map, 1) == -1) {
+            perror("setenv");
+            return 2;
+        }
+    }
+
+    (void)trace_execvp(*cmd, cmd);
+    perror("execvp");
+    return 2;
+}
+
 int
 main(int const argc, char *const *const argv)
 {
-    for (int opt; opt = getopt(argc, argv, "+"), opt != -1;) {
+    trace_init("openpidfd");
+    struct pids pids = { 0 };
+    bool bulkflag = false;
+    bool envflag = false;
+    for (int opt; opt = getopt(argc, argv, "+c:eg:l:"), opt != -1;) {
         switch (opt) {
+        case 'c': {
+            int pid;
+            if (!str2num(optarg, NULL, &pid) ||
+                !pids_fromchildren(&pids, (pid_t)pid)) {
+                return 2;
+            }
+            bulkflag = true;
+            break;
+        }
+        case 'e':
+            envflag = true;
+            break;
+        case 'g':
+            if (!pids_fromcgroup(&pids, optarg))
+                return 2;
+            bulkflag = true;
+            break;
+        case 'l':
+            if (!pids_fromlist(&pids, optarg))
+                return 2;
+            bulkflag = true;
+            break;
         default:
             usage();
             return 2;
         }
     }
 
-    if (argc - optind < 3) {
+    if (argc - optind < (bulkflag ? 2 : 3)) {
         usage();
         return 2;
     }
 
+    if (bulkflag) {
+        int basefd;
+        if (!str2num(argv[optind], NULL, &basefd))
+            return 2;
+        return do_bulk(&pids, basefd, envflag, &argv[optind + 1]);
+    }
+
     int fd, pid;
     for (int i = 0; i < 2; ++i) {
-        char *const str = argv[optind + i];
-        char *endptr;
-        errno = 0;
-        long const num = strtol(str, &endptr, 10);
-        if (errno) {
-            perror("strtol");
+        int *const nump = (int *const[]){ &fd, &pid }[i];
+        if (!str2num(argv[optind + i], NULL, nump))
             return 2;
-        }
-        if (endptr == str || num < 0 || num > INT_MAX || *endptr) {
-            if (fputs("Invalid argument.\n", stderr) == EOF)
-                perror("fputs");
-            return 2;
-        }
-        *(int *const[]){ &fd, &pid }[i] = (int)num;
     }
 
-    int const pidfd = syscall(SYS_pidfd_open, (pid_t)pid, 0);
+    int const pidfd = TRACE("pidfd_open",
+                            syscall(SYS_pidfd_open, (pid_t)pid, 0));
     if (pidfd == -1) {
         perror("pidfd_open");
         return 2;
     }
 
-    if (pidfd != fd) {
-        int ret;
-        do {
-            ret = dup2(pidfd, fd);
-        } while (ret == -1 && errno == EINTR);
-        if (ret == -1) {
-            perror("dup2");
-            return 2;
-        }
-    } else {
-        int const flags = fcntl(fd, F_GETFD);
-        if (flags == -1) {
-            perror("fcntl(F_GETFD)");
+    if (!placefd(pidfd, fd))
+        return 2;
+
+    if (envflag) {
+        char buf[10 + 1 + 10 + 1];
+        int const sz = snprintf(buf, sizeof buf, "%d:%d", pid, fd);
+        if (sz < 0) {
+            perror("snprintf");
             return 2;
         }
-        if ((flags & FD_CLOEXEC) &&
-            fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
-            perror("fcntl(F_SETFD)");
+        if (setenv("OPENPIDFD_FDS", buf, 1) == -1) {
+            perror("setenv");
             return 2;
         }
     }
 
-    (void)execvp(argv[optind + 2], &argv[optind + 2]);
+    (void)trace_execvp(argv[optind + 2], &argv[optind + 2]);
     perror("execvp");
     return 2;
 }
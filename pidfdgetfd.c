@@ -1,84 +1,392 @@
+#include <dirent.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
+struct candidate {
+    int fd;
+    bool mustlisten;
+};
+
+enum {
+    SELECT_SOCKET = 1 << 0,
+    SELECT_LISTEN = 1 << 1,
+    SELECT_PIPE = 1 << 2,
+    SELECT_GLOB = 1 << 3,
+};
+
 static void
 usage(void)
 {
     static char const message[] =
-        "Usage: pidfdgetfd pidfd targetfd fd cmd [args]...\n";
+        "Usage: pidfdgetfd [-e] pidfd targetfd fd cmd [args]...\n"
+        "Usage: pidfdgetfd -a [-e] [-g pattern] [-t type]... pidfd basefd "
+        "cmd [args]...\n";
     if (fputs(message, stderr) == EOF)
         perror("fputs");
 }
 
+static bool
+str2fd(char const *const str, int *const fdp)
+{
+    char *endptr;
+    errno = 0;
+    long const num = strtol(str, &endptr, 10);
+    if (errno) {
+        perror("strtol");
+        return false;
+    }
+    if (endptr == str || num < 0 || num > INT_MAX || *endptr) {
+        if (fputs("Invalid argument.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *fdp = (int)num;
+    return true;
+}
+
+static int
+comparcandidate(void const *const a, void const *const b)
+{
+    int const fda = ((struct candidate const *)a)->fd;
+    int const fdb = ((struct candidate const *)b)->fd;
+    return (fda > fdb) - (fda < fdb);
+}
+
+static pid_t
+pidfd_getpid(int const pidfd)
+{
+    char path[sizeof "/proc/self/fdinfo/" + 10];
+    int const sz = snprintf(path, sizeof path, "/proc/self/fdinfo/%d",
+                            pidfd);
+    if (sz < 0 || (size_t)sz >= sizeof path) {
+        perror("snprintf");
+        return -1;
+    }
+    FILE *const fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen");
+        return -1;
+    }
+    pid_t pid = -1;
+    char line[64];
+    while (fgets(line, sizeof line, fp)) {
+        if (!strncmp(line, "Pid:", 4)) {
+            pid = strtol(&line[4], NULL, 10);
+            break;
+        }
+    }
+    (void)fclose(fp);
+    if (pid <= 0) {
+        if (fputs("pidfd does not refer to a live process.\n", stderr)
+            == EOF) {
+            perror("fputs");
+        }
+        return -1;
+    }
+    return pid;
+}
+
+static struct candidate *
+selectfds(pid_t const pid, int const select, char const *const pattern,
+          size_t *const np)
+{
+    char path[sizeof "/proc//fd" + 10];
+    int const sz = snprintf(path, sizeof path, "/proc/%d/fd", pid);
+    if (sz < 0 || (size_t)sz >= sizeof path) {
+        perror("snprintf");
+        return NULL;
+    }
+    DIR *const dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return NULL;
+    }
+
+    struct candidate *fds = NULL;
+    size_t n = 0;
+    size_t size = 0;
+    for (struct dirent *de; errno = 0, de = readdir(dir);) {
+        if (de->d_name[0] == '.')
+            continue;
+        bool mustlisten = false;
+        if (select) {
+            char link[PATH_MAX];
+            ssize_t const len =
+                readlinkat(dirfd(dir), de->d_name, link, sizeof link - 1);
+            if (len == -1) {
+                if (errno == ENOENT)
+                    continue;
+                perror("readlinkat");
+                goto fail;
+            }
+            link[len] = '\0';
+            bool const issocket = !strncmp(link, "socket:", 7);
+            if (!((select & SELECT_SOCKET && issocket) ||
+                  (select & SELECT_PIPE && !strncmp(link, "pipe:", 5)) ||
+                  (select & SELECT_GLOB && !fnmatch(pattern, link, 0)))) {
+                if (!(select & SELECT_LISTEN && issocket))
+                    continue;
+                mustlisten = true;
+            }
+        }
+        if (n == size) {
+            size = size ? size * 2 : 16;
+            struct candidate *const newfds =
+                realloc(fds, size * sizeof *fds);
+            if (!newfds) {
+                perror("realloc");
+                goto fail;
+            }
+            fds = newfds;
+        }
+        fds[n].fd = strtol(de->d_name, NULL, 10);
+        fds[n++].mustlisten = mustlisten;
+    }
+    if (errno) {
+        perror("readdir");
+        goto fail;
+    }
+
+    (void)closedir(dir);
+    qsort(fds, n, sizeof *fds, comparcandidate);
+    *np = n;
+    return fds;
+
+fail:
+    (void)closedir(dir);
+    free(fds);
+    return NULL;
+}
+
+static bool
+placefd(int const gotfd, int const fd)
+{
+    /* pidfd_getfd(2) always sets close-on-exec, no need to F_GETFD */
+    if (gotfd == fd) {
+        if (TRACE("fcntl", fcntl(fd, F_SETFD, 0)) == -1) {
+            perror("fcntl(F_SETFD)");
+            return false;
+        }
+        return true;
+    }
+
+    int ret;
+    do {
+        ret = TRACE("dup2", dup2(gotfd, fd));
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("dup2");
+        return false;
+    }
+    return true;
+}
+
+static int
+do_bulk(int pidfd, int const basefd, int const select,
+        char const *const pattern, bool const envflag,
+        char *const *const cmd)
+{
+    pid_t const pid = pidfd_getpid(pidfd);
+    if (pid == -1)
+        return 2;
+
+    size_t n;
+    struct candidate *const srcfds = selectfds(pid, select, pattern, &n);
+    if (!srcfds)
+        return 2;
+    if (n > (size_t)(INT_MAX - basefd)) {
+        if (fputs("Too many file descriptors.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
+    if (pidfd >= basefd && (size_t)(pidfd - basefd) < n) {
+        int const newpidfd = fcntl(pidfd, F_DUPFD_CLOEXEC, basefd + (int)n);
+        if (newpidfd == -1) {
+            perror("fcntl(F_DUPFD_CLOEXEC)");
+            return 2;
+        }
+        /* skipped candidates would leave it in the range for cmd */
+        if (close(pidfd) == -1 && errno != EINTR) {
+            perror("close");
+            return 2;
+        }
+        pidfd = newpidfd;
+    }
+
+    char *map = NULL;
+    size_t maplen = 0;
+    if (envflag) {
+        map = malloc(n * (10 + 1 + 10 + 1) + 1);
+        if (!map) {
+            perror("malloc");
+            return 2;
+        }
+        map[0] = '\0';
+    }
+
+    int nextfd = basefd;
+    for (size_t i = 0; i < n; ++i) {
+        int const gotfd = TRACE("pidfd_getfd",
+                                syscall(SYS_pidfd_getfd, pidfd,
+                                        srcfds[i].fd, 0));
+        if (gotfd == -1) {
+            if (errno == EBADF)
+                continue;
+            perror("pidfd_getfd");
+            return 2;
+        }
+
+        if (srcfds[i].mustlisten) {
+            int listening;
+            socklen_t len = sizeof listening;
+            if (getsockopt(gotfd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+                           &len) == -1) {
+                perror("getsockopt(SO_ACCEPTCONN)");
+                return 2;
+            }
+            if (!listening) {
+                if (close(gotfd) == -1 && errno != EINTR) {
+                    perror("close");
+                    return 2;
+                }
+                continue;
+            }
+        }
+
+        if (!placefd(gotfd, nextfd))
+            return 2;
+        if (gotfd != nextfd && close(gotfd) == -1 && errno != EINTR) {
+            perror("close");
+            return 2;
+        }
+
+        if (envflag) {
+            int const sz = sprintf(&map[maplen], &",%d:%d"[!maplen],
+                                   srcfds[i].fd, nextfd);
+            if (sz < 0) {
+                perror("sprintf");
+                return 2;
+            }
+            maplen += sz;
+        }
+        ++nextfd;
+    }
+
+    if (envflag && setenv("PIDFDGETFD_FDS", map, 1) == -1) {
+        perror("setenv");
+        return 2;
+    }
+
+    (void)trace_execvp(*cmd, cmd);
+    perror("execvp");
+    return 2;
+}
+
 int
 main(int const argc, char *const *const argv)
 {
-    for (int opt; opt = getopt(argc, argv, "+"), opt != -1;) {
+    trace_init("pidfdgetfd");
+    bool allflag = false;
+    bool envflag = false;
+    int select = 0;
+    char const *pattern = NULL;
+    for (int opt; opt = getopt(argc, argv, "+aeg:t:"), opt != -1;) {
         switch (opt) {
+        case 'a':
+            allflag = true;
+            break;
+        case 'e':
+            envflag = true;
+            break;
+        case 'g':
+            pattern = optarg;
+            select |= SELECT_GLOB;
+            break;
+        case 't':
+            if (!strcmp(optarg, "socket")) {
+                select |= SELECT_SOCKET;
+            } else if (!strcmp(optarg, "listen")) {
+                select |= SELECT_LISTEN;
+            } else if (!strcmp(optarg, "pipe")) {
+                select |= SELECT_PIPE;
+            } else {
+                if (fputs("Invalid type.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            break;
         default:
             usage();
             return 2;
         }
     }
 
-    if (argc - optind < 4) {
+    if (select && !allflag) {
+        if (fputs("-g and -t can only be used with -a.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
+    if (argc - optind < (allflag ? 3 : 4)) {
         usage();
         return 2;
     }
 
-    int pidfd, targetfd, fd;
-    for (int i = 0; i < 3; ++i) {
-        char *const str = argv[optind + i];
-        char *endptr;
-        errno = 0;
-        long const num = strtol(str, &endptr, 10);
-        if (errno) {
-            perror("strtol");
+    if (allflag) {
+        int pidfd, basefd;
+        if (!str2fd(argv[optind], &pidfd) ||
+            !str2fd(argv[optind + 1], &basefd)) {
             return 2;
         }
-        if (endptr == str || num < 0 || num > INT_MAX || *endptr) {
-            if (fputs("Invalid argument.\n", stderr) == EOF)
-                perror("fputs");
+        return do_bulk(pidfd, basefd, select, pattern, envflag,
+                       &argv[optind + 2]);
+    }
+
+    int pidfd, targetfd, fd;
+    for (int i = 0; i < 3; ++i) {
+        int *const fdp = (int *const[]){ &pidfd, &targetfd, &fd }[i];
+        if (!str2fd(argv[optind + i], fdp))
             return 2;
-        }
-        *(int *const[]){ &pidfd, &targetfd, &fd }[i] = (int)num;
     }
 
-    int const gotfd = syscall(SYS_pidfd_getfd, pidfd, targetfd, 0);
+    int const gotfd = TRACE("pidfd_getfd",
+                            syscall(SYS_pidfd_getfd, pidfd, targetfd, 0));
     if (gotfd == -1) {
         perror("pidfd_getfd");
         return 2;
     }
 
-    if (gotfd != fd) {
-        int ret;
-        do {
-            ret = dup2(gotfd, fd);
-        } while (ret == -1 && errno == EINTR);
-        if (ret == -1) {
-            perror("dup2");
-            return 2;
-        }
-    } else {
-        int const flags = fcntl(fd, F_GETFD);
-        if (flags == -1) {
-            perror("fcntl(F_GETFD)");
+    if (!placefd(gotfd, fd))
+        return 2;
+
+    if (envflag) {
+        char buf[10 + 1 + 10 + 1];
+        int const sz = snprintf(buf, sizeof buf, "%d:%d", targetfd, fd);
+        if (sz < 0) {
+            perror("snprintf");
             return 2;
         }
-        if ((flags & FD_CLOEXEC) &&
-            fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
-            perror("fcntl(F_SETFD)");
+        if (setenv("PIDFDGETFD_FDS", buf, 1) == -1) {
+            perror("setenv");
             return 2;
         }
     }
 
-    (void)execvp(argv[optind + 3], &argv[optind + 3]);
+    (void)trace_execvp(argv[optind + 3], &argv[optind + 3]);
     perror("execvp");
     return 2;
 }
@@ -1,17 +1,66 @@
+#define _GNU_SOURCE /* F_GETPIPE_SZ, F_SETPIPE_SZ, POLLRDHUP, tee */
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
+#define EVENTS \
+    EVENT(in, POLLIN) \
+    EVENT(out, POLLOUT) \
+    EVENT(pri, POLLPRI) \
+    EVENT(rdhup, POLLRDHUP) \
+
+enum {
+    EPOLL_MINFDS = 8,
+};
+
+enum {
+    STATE_PENDING,
+    STATE_READY,
+    STATE_FAILED,
+};
+
+struct target {
+    int fd;
+    short events;
+    short state;
+};
+
+struct waiter {
+    struct target *targets;
+    size_t n;
+    struct pollfd *pollfds;
+    int epfd;
+    int bytes;
+    int records;
+    char delimiter;
+    int scratch[2];
+    char *peekbuf;
+    size_t peeksize;
+};
+
 static void
 usage(void)
 {
     static char const message[] =
-        "Usage: pollinfd [-t timeout] fd [cmd] [args]...\n";
+        "Usage: pollinfd [-ae] [-b bytes] [-d delimiter] [-q quorum] "
+        "[-r records] [-s spin]\n"
+        "                [-t timeout] fd[:event[+event]...][,...] "
+        "[cmd] [args]...\n";
     if (fputs(message, stderr) == EOF)
         perror("fputs");
 }
@@ -36,16 +85,493 @@ str2num(char const *const str, int const min, int const max,
     return true;
 }
 
+/* a plain number is in milliseconds; s, ms, us and ns suffixes and
+ * fractions are accepted.  Negative durations are infinite.  */
+static bool
+str2duration(char const *const str, long long *const nsp,
+             char const *const err)
+{
+    static struct {
+        char const *suffix;
+        double scale;
+    } const units[] = {
+        { "", 1e6, },
+        { "s", 1e9, },
+        { "ms", 1e6, },
+        { "us", 1e3, },
+        { "ns", 1, },
+    };
+    char *endptr;
+    errno = 0;
+    double const num = strtod(str, &endptr);
+    if (errno) {
+        perror("strtod");
+        return false;
+    }
+    if (endptr != str && isfinite(num)) {
+        for (size_t i = 0; i < sizeof units / sizeof *units; ++i) {
+            if (strcmp(endptr, units[i].suffix))
+                continue;
+            double const ns = num * units[i].scale;
+            *nsp = ns < 0 ? -1 : ns > (double)LLONG_MAX ? LLONG_MAX : ns;
+            return true;
+        }
+    }
+    if (fputs(err, stderr) == EOF)
+        perror("fputs");
+    return false;
+}
+
+static short
+str2events(char const *str, size_t const len)
+{
+    short events = 0;
+    for (char const *const end = &str[len]; str < end;) {
+        char const *sep = memchr(str, '+', end - str);
+        if (!sep)
+            sep = end;
+        size_t const elen = sep - str;
+#define EVENT(x, e) \
+        if (elen == sizeof #x - 1 && !memcmp(str, #x, elen)) \
+            events |= e; \
+        else
+        EVENTS
+#undef EVENT
+            return 0;
+        str = sep == end ? end : &sep[1];
+    }
+    return events;
+}
+
+static int
+compartarget(void const *const a, void const *const b)
+{
+    int const fda = ((struct target const *)a)->fd;
+    int const fdb = ((struct target const *)b)->fd;
+    return (fda > fdb) - (fda < fdb);
+}
+
+static struct target *
+str2targets(char const *str, size_t *const np)
+{
+    size_t n = 1;
+    for (char const *p = str; *p; ++p)
+        n += *p == ',';
+    struct target *const targets = calloc(n, sizeof *targets);
+    if (!targets) {
+        perror("calloc");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        char *endptr;
+        errno = 0;
+        long const fd = strtol(str, &endptr, 10);
+        if (errno) {
+            perror("strtol");
+            goto fail;
+        }
+        if (endptr == str || fd < 0 || fd > INT_MAX)
+            goto invalid;
+        targets[i].fd = (int)fd;
+        targets[i].events = POLLIN;
+        str = endptr;
+        if (*str == ':') {
+            ++str;
+            size_t const len = strcspn(str, ",");
+            targets[i].events = str2events(str, len);
+            if (!targets[i].events) {
+                if (fputs("Invalid event.\n", stderr) == EOF)
+                    perror("fputs");
+                goto fail;
+            }
+            str += len;
+        }
+        if (*str != (i + 1 < n ? ',' : '\0'))
+            goto invalid;
+        ++str;
+    }
+
+    qsort(targets, n, sizeof *targets, compartarget);
+    for (size_t i = 1; i < n; ++i) {
+        if (targets[i].fd == targets[i - 1].fd) {
+            static char const efmt[] = "Duplicate `%d' not allowed.\n";
+            if (fprintf(stderr, efmt, targets[i].fd) == EOF)
+                perror("fprintf");
+            goto fail;
+        }
+    }
+
+    *np = n;
+    return targets;
+
+invalid:
+    if (fputs("Invalid fd.\n", stderr) == EOF)
+        perror("fputs");
+fail:
+    free(targets);
+    return NULL;
+}
+
+static long long
+now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        perror("clock_gettime");
+        return -1;
+    }
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* how much input fd can hold, or INT_MAX if that is not known; a
+ * threshold above it could never be reached, the writer would block */
+static int
+capacity(int const fd)
+{
+    int const pipesize = fcntl(fd, F_GETPIPE_SZ);
+    if (pipesize != -1)
+        return pipesize;
+    int rcvbuf;
+    socklen_t len = sizeof rcvbuf;
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == 0)
+        return rcvbuf;
+    return INT_MAX;
+}
+
+static bool
+waiter_init(struct waiter *const w)
+{
+    bool const threshold = w->bytes || w->records;
+    if (w->n < EPOLL_MINFDS && !threshold) {
+        w->epfd = -1;
+        w->pollfds = calloc(w->n, sizeof *w->pollfds);
+        if (!w->pollfds) {
+            perror("calloc");
+            return false;
+        }
+        for (size_t i = 0; i < w->n; ++i) {
+            w->pollfds[i].fd = w->targets[i].fd;
+            w->pollfds[i].events = w->targets[i].events;
+        }
+        return true;
+    }
+
+    w->pollfds = NULL;
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    for (size_t i = 0; i < w->n; ++i) {
+        /* with a threshold, wake up on every arrival, not while any
+         * input is buffered */
+        struct epoll_event ev = {
+            .events = w->targets[i].events | (threshold ? EPOLLET : 0),
+            .data.u64 = i,
+        };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->targets[i].fd, &ev)) {
+            if (errno == EPERM && threshold) {
+                /* regular files and the like cannot be waited on */
+                static char const epollperm[] =
+                    "Thresholds need file descriptors that can be polled.\n";
+                if (fputs(epollperm, stderr) == EOF)
+                    perror("fputs");
+                return false;
+            }
+            if (errno == EPERM) {
+                /* like poll(2), treat files that epoll rejects as ready */
+                w->targets[i].state = STATE_READY;
+                continue;
+            }
+            if (errno == EBADF) {
+                static char const epollnval[] =
+                    "File descriptor cannot be used with poll.\n";
+                if (fputs(epollnval, stderr) == EOF)
+                    perror("fputs");
+                return false;
+            }
+            perror("epoll_ctl");
+            return false;
+        }
+        /* every record is at least its delimiter */
+        int const need = w->bytes > w->records ? w->bytes : w->records;
+        if (threshold && (w->targets[i].events & POLLIN) &&
+            need > capacity(w->targets[i].fd)) {
+            static char const efmt[] =
+                "Threshold above the buffer size of fd %d.\n";
+            if (fprintf(stderr, efmt, w->targets[i].fd) < 0)
+                perror("fprintf");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+waiter_done(struct waiter *const w, size_t const i, short const state)
+{
+    w->targets[i].state = state;
+    if (w->pollfds) {
+        w->pollfds[i].fd = -1;
+        return true;
+    }
+    if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->targets[i].fd, NULL)) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+static ssize_t
+waiter_peek(struct waiter *const w, int const fd, size_t const size)
+{
+    if (w->peeksize < size) {
+        char *const newbuf = realloc(w->peekbuf, size);
+        if (!newbuf) {
+            perror("realloc");
+            return -1;
+        }
+        w->peekbuf = newbuf;
+        w->peeksize = size;
+    }
+
+    ssize_t const n = TRACE("recv", recv(fd, w->peekbuf, size,
+                                         MSG_PEEK | MSG_DONTWAIT));
+    if (n != -1 || errno != ENOTSOCK) {
+        if (n == -1)
+            perror("recv");
+        return n;
+    }
+
+    /* pipes cannot be peeked at, but tee(2) copies without consuming */
+    if (w->scratch[0] == -1) {
+        if (pipe2(w->scratch, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            return -1;
+        }
+        int const pipesize = fcntl(fd, F_GETPIPE_SZ);
+        if (pipesize == -1) {
+            perror("fcntl(F_GETPIPE_SZ)");
+            return -1;
+        }
+        (void)fcntl(w->scratch[1], F_SETPIPE_SZ, pipesize);
+    }
+    ssize_t const nteed = TRACE("tee", tee(fd, w->scratch[1], size,
+                                           SPLICE_F_NONBLOCK));
+    if (nteed == -1) {
+        if (errno == EAGAIN)
+            return 0;
+        if (errno == EINVAL) {
+            static char const epeek[] =
+                "Records can only be counted on pipes and sockets.\n";
+            if (fputs(epeek, stderr) == EOF)
+                perror("fputs");
+        } else {
+            perror("tee");
+        }
+        return -1;
+    }
+    for (ssize_t nread = 0; nread < nteed;) {
+        ssize_t const ret =
+            read(w->scratch[0], &w->peekbuf[nread], nteed - nread);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return -1;
+        }
+        nread += ret;
+    }
+    return nteed;
+}
+
+/* 1 if enough input is buffered in target i, 0 if not, -1 on error;
+ * with partial, any input is enough */
+static int
+waiter_enough(struct waiter *const w, size_t const i, bool const partial)
+{
+    int const fd = w->targets[i].fd;
+    int avail;
+    if (ioctl(fd, FIONREAD, &avail) == -1) {
+        perror("ioctl(FIONREAD)");
+        return -1;
+    }
+    if (partial || !avail)
+        return avail > 0;
+    if (avail < w->bytes)
+        return 0;
+    if (!w->records)
+        return 1;
+
+    ssize_t const len = waiter_peek(w, fd, avail);
+    if (len == -1)
+        return -1;
+    char const *const end = &w->peekbuf[len];
+    int count = 0;
+    for (char const *p = w->peekbuf; count < w->records; ++count) {
+        p = memchr(p, w->delimiter, end - p);
+        if (!p)
+            break;
+        ++p;
+    }
+    return count >= w->records;
+}
+
+static bool
+waiter_event(struct waiter *const w, size_t const i, short const revents)
+{
+    if (revents & POLLNVAL) {
+        static char const epollnval[] =
+            "File descriptor cannot be used with poll.\n";
+        if (fputs(epollnval, stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    short const events = w->targets[i].events;
+    if ((w->bytes || w->records) && revents & events & POLLIN) {
+        bool const hup = revents & (POLLERR | POLLHUP);
+        int const enough = waiter_enough(w, i, hup);
+        if (enough == -1)
+            return false;
+        if (enough)
+            return waiter_done(w, i, STATE_READY);
+        if (hup)
+            return waiter_done(w, i, STATE_FAILED);
+        if (!(revents & events & ~POLLIN))
+            return true;
+    }
+    if (revents & events)
+        return waiter_done(w, i, STATE_READY);
+    if (revents & (POLLERR | POLLHUP))
+        return waiter_done(w, i, STATE_FAILED);
+    return true;
+}
+
+/* at the deadline, whatever input is buffered is enough */
+static bool
+waiter_flush(struct waiter *const w)
+{
+    for (size_t i = 0; i < w->n; ++i) {
+        if (w->targets[i].state != STATE_PENDING ||
+            !(w->targets[i].events & POLLIN)) {
+            continue;
+        }
+        int const enough = waiter_enough(w, i, true);
+        if (enough == -1)
+            return false;
+        if (enough && !waiter_done(w, i, STATE_READY))
+            return false;
+    }
+    return true;
+}
+
+/* 0 on timeout, -1 on error, > 0 otherwise (also when interrupted) */
+static int
+waiter_wait(struct waiter *const w, long long const timeout)
+{
+    struct timespec const ts = {
+        .tv_sec = timeout / 1000000000,
+        .tv_nsec = timeout % 1000000000,
+    };
+    struct timespec const *const tsp = timeout < 0 ? NULL : &ts;
+
+    int nready;
+    if (w->pollfds) {
+        nready = TRACE("ppoll", ppoll(w->pollfds, w->n, tsp, NULL));
+        if (nready == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                return 1;
+            perror("ppoll");
+            return -1;
+        }
+        for (size_t i = 0; i < w->n; ++i) {
+            if (w->pollfds[i].fd != -1 && w->pollfds[i].revents &&
+                !waiter_event(w, i, w->pollfds[i].revents)) {
+                return -1;
+            }
+        }
+        return nready;
+    }
+
+    struct epoll_event events[EPOLL_MINFDS];
+    nready = TRACE("epoll_pwait2", epoll_pwait2(w->epfd, events,
+                                                EPOLL_MINFDS, tsp, NULL));
+    if (nready == -1 && errno == ENOSYS) {
+        long long const ms = timeout < 0 ? -1 : (timeout + 999999) / 1000000;
+        nready = epoll_wait(w->epfd, events, EPOLL_MINFDS,
+                            ms > INT_MAX ? INT_MAX : (int)ms);
+    }
+    if (nready == -1) {
+        if (errno == EINTR)
+            return 1;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < nready; ++i) {
+        if (!waiter_event(w, events[i].data.u64, events[i].events))
+            return -1;
+    }
+    return nready;
+}
+
 int
 main(int const argc, char **const argv)
 {
-    int timeout = -1;
+    trace_init("pollinfd");
+    long long timeout = -1;
+    long long spin = 0;
+    int quorum = 1;
+    int bytes = 0;
+    int records = 0;
+    char delimiter = '\n';
+    bool allflag = false;
+    bool envflag = false;
 
-    for (int opt; opt = getopt(argc, argv, "+t:"), opt != -1;) {
+    for (int opt; opt = getopt(argc, argv, "+ab:d:eq:r:s:t:"), opt != -1;) {
         switch (opt) {
+        case 'a':
+            allflag = true;
+            break;
+        case 'b': {
+            static const char ebytes[] = "Invalid byte count.\n";
+            if (!str2num(optarg, 1, INT_MAX, &bytes, ebytes))
+                return 2;
+            break;
+        }
+        case 'd':
+            if (!optarg[0] || !optarg[1]) {
+                delimiter = *optarg;
+                break;
+            }
+            if (fputs("Invalid delimiter.\n", stderr) == EOF)
+                perror("fputs");
+            return 2;
+        case 'e':
+            envflag = true;
+            break;
+        case 'q': {
+            static const char equorum[] = "Invalid quorum.\n";
+            if (!str2num(optarg, 1, INT_MAX, &quorum, equorum))
+                return 2;
+            allflag = false;
+            break;
+        }
+        case 'r': {
+            static const char erecords[] = "Invalid record count.\n";
+            if (!str2num(optarg, 1, INT_MAX, &records, erecords))
+                return 2;
+            break;
+        }
+        case 's': {
+            static const char espin[] = "Invalid spin budget.\n";
+            if (!str2duration(optarg, &spin, espin))
+                return 2;
+            break;
+        }
         case 't': {
             static const char etimeout[] = "Invalid timeout.\n";
-            if (!str2num(optarg, INT_MIN, INT_MAX, &timeout, etimeout))
+            if (!str2duration(optarg, &timeout, etimeout))
                 return 2;
             break;
         }
@@ -60,43 +586,104 @@ main(int const argc, char **const argv)
         return 2;
     }
 
-    char const *const argfd = argv[optind];
+    char const *const argfds = argv[optind];
     char **const command = &argv[optind + 1];
 
-    struct pollfd pollfd = {
-        .events = POLLIN,
+    struct waiter w = {
+        .bytes = bytes,
+        .records = records,
+        .delimiter = delimiter,
+        .scratch = { -1, -1 },
     };
-
-    if (!str2num(argfd, 0, INT_MAX, &pollfd.fd, "Invalid fd.\n"))
+    w.targets = str2targets(argfds, &w.n);
+    if (!w.targets)
+        return 2;
+    if (allflag)
+        quorum = w.n;
+    if ((size_t)quorum > w.n) {
+        if (fputs("Invalid quorum.\n", stderr) == EOF)
+            perror("fputs");
         return 2;
+    }
 
-    do {
-        switch (poll(&pollfd, 1, timeout)) {
-        case 0:
-            return 1;
-        case -1:
-            if (errno == EINTR || errno == EAGAIN)
-                continue;
-            perror("poll");
+    long long deadline = -1;
+    long long spindeadline = -1;
+    if (timeout > 0 || spin > 0) {
+        long long const start = now();
+        if (start == -1)
             return 2;
+        if (timeout > 0)
+            deadline = timeout > LLONG_MAX - start ? -1 : start + timeout;
+        if (spin > 0) {
+            spindeadline = spin > LLONG_MAX - start ? LLONG_MAX
+                                                    : start + spin;
         }
-    } while (0);
+    }
 
-    if (!(pollfd.revents & POLLIN)) {
-        if (pollfd.revents & POLLNVAL) {
-            static char const epollnval[] =
-                "File descriptor cannot be used with poll.\n";
-            if (fputs(epollnval, stderr) == EOF)
-                perror("fputs");
+    if (!waiter_init(&w))
+        return 2;
+
+    for (bool flushed = false;;) {
+        size_t ready = 0;
+        size_t pending = 0;
+        for (size_t i = 0; i < w.n; ++i) {
+            ready += w.targets[i].state == STATE_READY;
+            pending += w.targets[i].state == STATE_PENDING;
+        }
+        if (ready >= (size_t)quorum)
+            break;
+        if (ready + pending < (size_t)quorum)
+            return 1;
+
+        long long left = timeout;
+        bool spinning = false;
+        if (deadline != -1 || spindeadline != -1) {
+            long long const t = now();
+            if (t == -1)
+                return 2;
+            if (deadline != -1)
+                left = deadline > t ? deadline - t : 0;
+            spinning = t < spindeadline && left;
+        }
+        int const ret = waiter_wait(&w, spinning ? 0 : left);
+        if (ret == -1)
             return 2;
+        if (ret == 0 && !spinning) {
+            if (!(bytes || records) || flushed)
+                return 1;
+            if (!waiter_flush(&w))
+                return 2;
+            flushed = true;
         }
-        return 1;
     }
 
     if (!*command)
         return 0;
 
-    (void)execvp(*command, command);
+    if (envflag) {
+        char *const buf = malloc(w.n * (10 + 1));
+        if (!buf) {
+            perror("malloc");
+            return 2;
+        }
+        size_t len = 0;
+        for (size_t i = 0; i < w.n; ++i) {
+            if (w.targets[i].state != STATE_READY)
+                continue;
+            int const sz = sprintf(&buf[len], &",%d"[!len], w.targets[i].fd);
+            if (sz < 0) {
+                perror("sprintf");
+                return 2;
+            }
+            len += sz;
+        }
+        if (setenv("POLLINFD_READY", buf, 1) == -1) {
+            perror("setenv");
+            return 2;
+        }
+    }
+
+    (void)trace_execvp(*command, command);
     perror("execvp");
     return 2;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* F_SETPIPE_SZ, O_DIRECT, O_NOATIME */
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -6,7 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <linux/close_range.h>
+#include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/reg.h>
 #include <sys/syscall.h>
@@ -14,13 +18,43 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 #define SPECIALSOURCES \
     SPECIALSOURCE(close) \
+    SPECIALSOURCE(keep) \
 
 #define SPECIALTARGETS \
     SPECIALTARGET(any) \
     SPECIALTARGET(cwd) \
 
+#define STATUSFLAGS \
+    STATUSFLAG(append, O_APPEND) \
+    STATUSFLAG(direct, O_DIRECT) \
+    STATUSFLAG(noatime, O_NOATIME) \
+    STATUSFLAG(nonblock, O_NONBLOCK) \
+
+#define ADVICES \
+    ADVICE(normal, POSIX_FADV_NORMAL) \
+    ADVICE(sequential, POSIX_FADV_SEQUENTIAL) \
+    ADVICE(random, POSIX_FADV_RANDOM) \
+    ADVICE(willneed, POSIX_FADV_WILLNEED) \
+    ADVICE(dontneed, POSIX_FADV_DONTNEED) \
+    ADVICE(noreuse, POSIX_FADV_NOREUSE) \
+
+struct fdrange {
+    unsigned first;
+    unsigned last;
+};
+
+struct tuning {
+    int pipesize;
+    int setflags;
+    int clearflags;
+    int advice;
+    long readahead;
+};
+
 enum {
     SPECIALSOURCES_zero,
 #define SPECIALSOURCE(x) SPECIALSOURCE_##x,
@@ -40,8 +74,12 @@ static void
 usage(void)
 {
     static char const msg[] =
-        "Usage: psendfd [-ef] [-m mintargetfd] [-P sourcepid] pid fd "
-        "targetfd [cmd]...\n";
+        "Usage: psendfd [-ef] [-a advice] [-m mintargetfd] "
+        "[-M length [-p prot]]\n"
+        "               [-o flag]... [-O flag]... [-P sourcepid] "
+        "[-r length]\n"
+        "               [-s pipesize] pid fd targetfd [cmd]...\n"
+        "Usage: psendfd [-cf] pid close fd|first-[last][,...] [cmd]...\n";
     if (fputs(msg, stderr) == EOF)
         perror("fputs");
 }
@@ -61,6 +99,102 @@ str2int(char const *const str)
     return (int)num;
 }
 
+static int
+str2flag(char const *const str)
+{
+#define STATUSFLAG(x, f) if (!strcmp(str, #x)) return f;
+    STATUSFLAGS
+#undef STATUSFLAG
+    return 0;
+}
+
+static int
+str2advice(char const *const str)
+{
+#define ADVICE(x, a) if (!strcmp(str, #x)) return a;
+    ADVICES
+#undef ADVICE
+    return -1;
+}
+
+static struct fdrange *
+str2ranges(char const *str, size_t *const np)
+{
+    size_t n = 1;
+    for (char const *p = str; *p; ++p)
+        n += *p == ',';
+    struct fdrange *const ranges = malloc(n * sizeof *ranges);
+    if (!ranges) {
+        perror("malloc");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        char *endptr;
+        errno = 0;
+        long const first = strtol(str, &endptr, 10);
+        if (errno) {
+            perror("strtol");
+            goto fail;
+        }
+        if (endptr == str || first < 0 || first > INT_MAX)
+            goto invalid;
+        long last = first;
+        if (*endptr == '-') {
+            str = &endptr[1];
+            if (*str == ',' || !*str) {
+                last = UINT_MAX;
+                endptr = (char *)str;
+            } else {
+                last = strtol(str, &endptr, 10);
+                if (errno) {
+                    perror("strtol");
+                    goto fail;
+                }
+                if (endptr == str || last < first || last > INT_MAX)
+                    goto invalid;
+            }
+        }
+        if (*endptr != (i + 1 < n ? ',' : '\0'))
+            goto invalid;
+        ranges[i].first = first;
+        ranges[i].last = last;
+        str = &endptr[1];
+    }
+
+    *np = n;
+    return ranges;
+
+invalid:
+    if (fputs("Invalid targetfd.\n", stderr) == EOF)
+        perror("fputs");
+fail:
+    free(ranges);
+    return NULL;
+}
+
+static int
+str2prot(char const *str)
+{
+    int prot = PROT_NONE;
+    for (; *str; ++str) {
+        switch (*str) {
+        case 'r':
+            prot |= PROT_READ;
+            break;
+        case 'w':
+            prot |= PROT_WRITE;
+            break;
+        case 'x':
+            prot |= PROT_EXEC;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return prot;
+}
+
 static void
 tracee_perror(char const *const msg, int const err)
 {
@@ -88,6 +222,7 @@ nextstop(pid_t const pid, int *const status)
 static bool
 do_syscall(pid_t const pid, struct user_regs_struct *const regs)
 {
+    long long const start = trace.fd == -1 ? 0 : trace_now();
     if (ptrace(PTRACE_SETREGS, pid, 0, regs) == -1) {
         perror("ptrace(PTRACE_SETREGS)");
         return false;
@@ -110,6 +245,8 @@ do_syscall(pid_t const pid, struct user_regs_struct *const regs)
             return false;
         }
     } while ((long)regs->rax == -ENOSYS);
+    if (trace.fd != -1)
+        trace_call("injected", start, regs->rax > -4096UL);
     return true;
 }
 
@@ -134,6 +271,101 @@ do_close(pid_t const pid, int const fd, bool const fflag,
     return 2;
 }
 
+static int
+do_setcloexec(pid_t const pid, int const fd,
+              struct user_regs_struct const *const savedregs)
+{
+    struct user_regs_struct regs = *savedregs;
+    regs.rax = SYS_fcntl;
+    regs.rdi = fd;
+    regs.rsi = F_SETFD;
+    regs.rdx = FD_CLOEXEC;
+    if (!do_syscall(pid, &regs))
+        return 2;
+    if (regs.rax == 0 || (long)regs.rax == -EBADF)
+        return 0;
+    tracee_perror("fcntl(F_SETFD)", -regs.rax);
+    return 2;
+}
+
+static int
+do_closefds(pid_t const pid, struct fdrange const *const ranges,
+            size_t const n, bool const cloexec, bool const fflag,
+            struct user_regs_struct const *const savedregs)
+{
+    unsigned const flags = cloexec ? CLOSE_RANGE_CLOEXEC : 0;
+
+    /* probe locally: do_syscall() cannot tell -ENOSYS from entry */
+    bool const haveclose_range =
+        syscall(SYS_close_range, ~0U, ~0U, flags) == 0;
+
+    DIR *dir = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned const first = ranges[i].first;
+        unsigned const last = ranges[i].last;
+        if (first == last && !cloexec) {
+            if (do_close(pid, first, fflag, savedregs))
+                goto fail;
+            continue;
+        }
+
+        if (haveclose_range) {
+            struct user_regs_struct regs = *savedregs;
+            regs.rax = SYS_close_range;
+            regs.rdi = first;
+            regs.rsi = last;
+            regs.rdx = flags;
+            if (!do_syscall(pid, &regs))
+                goto fail;
+            if ((long)regs.rax < 0) {
+                tracee_perror("close_range", -regs.rax);
+                goto fail;
+            }
+            continue;
+        }
+
+        if (!dir) {
+            char path[sizeof "/proc//fd" + 10];
+            int const sz = snprintf(path, sizeof path, "/proc/%d/fd", pid);
+            if (sz < 0 || (size_t)sz >= sizeof path) {
+                perror("snprintf");
+                goto fail;
+            }
+            dir = opendir(path);
+            if (!dir) {
+                perror("opendir");
+                goto fail;
+            }
+        } else {
+            rewinddir(dir);
+        }
+        for (struct dirent *de; errno = 0, de = readdir(dir);) {
+            if (de->d_name[0] == '.')
+                continue;
+            unsigned const fd = strtoul(de->d_name, NULL, 10);
+            if (fd < first || fd > last)
+                continue;
+            if (cloexec ? do_setcloexec(pid, fd, savedregs)
+                        : do_close(pid, fd, true, savedregs)) {
+                goto fail;
+            }
+        }
+        if (errno) {
+            perror("readdir");
+            goto fail;
+        }
+    }
+
+    if (dir)
+        (void)closedir(dir);
+    return 0;
+
+fail:
+    if (dir)
+        (void)closedir(dir);
+    return 2;
+}
+
 static int
 do_send(pid_t const pid, int const fd, int *const targetfdp,
         pid_t const sourcepid,
@@ -208,7 +440,7 @@ do_send(pid_t const pid, int const fd, int *const targetfdp,
             ret = 2;
     }
 
-    if (!ret)
+    if (!ret && targetfd < 0)
         *targetfdp = thefd;
 
     return ret;
@@ -241,15 +473,141 @@ do_fchdir(pid_t const pid, int const fd,
     return ret;
 }
 
+static int
+do_tune(pid_t const pid, int const fd, struct tuning const *const t,
+        struct user_regs_struct const *const savedregs)
+{
+    struct user_regs_struct regs;
+
+    if (t->pipesize >= 0) {
+        regs = *savedregs;
+        regs.rax = SYS_fcntl;
+        regs.rdi = fd;
+        regs.rsi = F_SETPIPE_SZ;
+        regs.rdx = t->pipesize;
+        if (!do_syscall(pid, &regs))
+            return 2;
+        if ((long)regs.rax < 0) {
+            tracee_perror("fcntl(F_SETPIPE_SZ)", -regs.rax);
+            return 2;
+        }
+    }
+
+    if (t->setflags || t->clearflags) {
+        regs = *savedregs;
+        regs.rax = SYS_fcntl;
+        regs.rdi = fd;
+        regs.rsi = F_GETFL;
+        if (!do_syscall(pid, &regs))
+            return 2;
+        if ((long)regs.rax < 0) {
+            tracee_perror("fcntl(F_GETFL)", -regs.rax);
+            return 2;
+        }
+        int const flags = regs.rax;
+        int const newflags = (flags | t->setflags) & ~t->clearflags;
+        if (newflags != flags) {
+            regs = *savedregs;
+            regs.rax = SYS_fcntl;
+            regs.rdi = fd;
+            regs.rsi = F_SETFL;
+            regs.rdx = newflags;
+            if (!do_syscall(pid, &regs))
+                return 2;
+            if ((long)regs.rax < 0) {
+                tracee_perror("fcntl(F_SETFL)", -regs.rax);
+                return 2;
+            }
+        }
+    }
+
+    if (t->advice >= 0) {
+        regs = *savedregs;
+        regs.rax = SYS_fadvise64;
+        regs.rdi = fd;
+        regs.rsi = 0;
+        regs.rdx = 0;
+        regs.r10 = t->advice;
+        if (!do_syscall(pid, &regs))
+            return 2;
+        if ((long)regs.rax < 0) {
+            tracee_perror("posix_fadvise", -regs.rax);
+            return 2;
+        }
+    }
+
+    if (t->readahead > 0) {
+        regs = *savedregs;
+        regs.rax = SYS_readahead;
+        regs.rdi = fd;
+        regs.rsi = 0;
+        regs.rdx = t->readahead;
+        if (!do_syscall(pid, &regs))
+            return 2;
+        if ((long)regs.rax < 0) {
+            tracee_perror("readahead", -regs.rax);
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static int
+do_mmap(pid_t const pid, int const fd, long const length, int const prot,
+        unsigned long *const addrp,
+        struct user_regs_struct const *const savedregs)
+{
+    struct user_regs_struct regs = *savedregs;
+    regs.rax = SYS_mmap;
+    regs.rdi = 0;
+    regs.rsi = length;
+    regs.rdx = prot;
+    regs.r10 = MAP_SHARED;
+    regs.r8 = fd;
+    regs.r9 = 0;
+    if (!do_syscall(pid, &regs))
+        return 2;
+    if (regs.rax > -4096UL) {
+        tracee_perror("mmap", -regs.rax);
+        return 2;
+    }
+    *addrp = regs.rax;
+    return 0;
+}
+
 int
 main(int const argc, char *const *const argv)
 {
+    trace_init("psendfd");
     pid_t sourcepid = -1;
+    bool cflag = false;
     bool eflag = false;
     bool fflag = false;
     int fdmin = -1;
-    for (int opt; opt = getopt(argc, argv, "+efm:P:"), opt != -1;) {
+    struct tuning tuning = {
+        .pipesize = -1,
+        .advice = -1,
+    };
+    bool tuneflag = false;
+    long maplength = 0;
+    int mapprot = PROT_READ | PROT_WRITE;
+    bool protflag = false;
+    static char const optstring[] = "+a:cefm:M:o:O:p:P:r:s:";
+    for (int opt; opt = getopt(argc, argv, optstring), opt != -1;) {
         switch (opt) {
+        case 'a':
+            tuning.advice = str2advice(optarg);
+            if (tuning.advice == -1) {
+                if (fputs("Invalid advice.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            tuneflag = true;
+            break;
+        case 'c':
+            cflag = true;
+            break;
         case 'e':
             eflag = true;
             break;
@@ -266,6 +624,48 @@ main(int const argc, char *const *const argv)
                 return 2;
             }
             break;
+        case 'M': {
+            char *endptr;
+            errno = 0;
+            maplength = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || maplength <= 0 || *endptr) {
+                if (fputs("Invalid mapping length.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            break;
+        }
+        case 'o':
+        case 'O': {
+            int const flag = str2flag(optarg);
+            if (!flag) {
+                if (fputs("Invalid status flag.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            if (opt == 'o') {
+                tuning.setflags |= flag;
+                tuning.clearflags &= ~flag;
+            } else {
+                tuning.clearflags |= flag;
+                tuning.setflags &= ~flag;
+            }
+            tuneflag = true;
+            break;
+        }
+        case 'p':
+            mapprot = str2prot(optarg);
+            if (mapprot == -1) {
+                if (fputs("Invalid protection.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            protflag = true;
+            break;
         case 'P':
             sourcepid = str2int(optarg);
             if (sourcepid <= -2) {
@@ -274,12 +674,43 @@ main(int const argc, char *const *const argv)
                 return 2;
             }
             break;
+        case 'r': {
+            char *endptr;
+            errno = 0;
+            tuning.readahead = strtol(optarg, &endptr, 10);
+            if (errno) {
+                perror("strtol");
+                return 2;
+            }
+            if (endptr == optarg || tuning.readahead <= 0 || *endptr) {
+                if (fputs("Invalid readahead length.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            tuneflag = true;
+            break;
+        }
+        case 's':
+            tuning.pipesize = str2int(optarg);
+            if (tuning.pipesize <= 0) {
+                if (fputs("Invalid pipe size.\n", stderr) == EOF)
+                    perror("fputs");
+                return 2;
+            }
+            tuneflag = true;
+            break;
         default:
             usage();
             return 2;
         }
     }
 
+    if (protflag && !maplength) {
+        if (fputs("-p can only be used with -M.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
     if (argc - optind < 3) {
         usage();
         return 2;
@@ -306,7 +737,19 @@ main(int const argc, char *const *const argv)
     }
 
     char const *const tfdstr = argv[optind + 2];
+    struct fdrange *ranges = NULL;
+    size_t nranges = 0;
+    if (fd == -SPECIALSOURCE_close) {
+        ranges = str2ranges(tfdstr, &nranges);
+        if (!ranges)
+            return 2;
+    } else if (cflag) {
+        if (fputs("-c can only be used with `close'.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
     int targetfd =
+        ranges ? (int)ranges[0].first :
 #define SPECIALTARGET(x) !strcmp(tfdstr, #x) ? -SPECIALTARGET_##x :
         SPECIALTARGETS
 #undef SPECIALTARGET
@@ -316,8 +759,21 @@ main(int const argc, char *const *const argv)
             perror("fputs");
         return 2;
     }
+    if (fd == -SPECIALSOURCE_keep && !tuneflag && !maplength) {
+        if (fputs("Nothing to do with `keep'.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+    if ((tuneflag || maplength) &&
+        (fd == -SPECIALSOURCE_close || targetfd == -SPECIALTARGET_cwd)) {
+        static char const emsg[] =
+            "Tuning and mapping cannot be used with `close' or `cwd'.\n";
+        if (fputs(emsg, stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
 
-    if (ptrace(PTRACE_ATTACH, pid, 0, 0) == -1) {
+    if (TRACE("ptrace", ptrace(PTRACE_ATTACH, pid, 0, 0)) == -1) {
         perror("ptrace(PTRACE_ATTACH)");
         return 2;
     }
@@ -342,12 +798,22 @@ main(int const argc, char *const *const argv)
         return 2;
     }
 
-    int const ret =
+    int ret =
         fd == -SPECIALSOURCE_close ?
-            do_close(pid, targetfd, fflag, &savedregs) :
+            do_closefds(pid, ranges, nranges, cflag, fflag, &savedregs) :
+        fd == -SPECIALSOURCE_keep ?
+            0 :
         targetfd == -SPECIALTARGET_cwd ?
             do_fchdir(pid, fd, &savedregs) :
         do_send(pid, fd, &targetfd, sourcepid, &savedregs, fdmin);
+    free(ranges);
+    if (!ret && tuneflag)
+        ret = do_tune(pid, targetfd, &tuning, &savedregs);
+    unsigned long mapaddr = 0;
+    if (!ret && maplength) {
+        ret = do_mmap(pid, targetfd, maplength, mapprot, &mapaddr,
+                      &savedregs);
+    }
 
     if (ptrace(PTRACE_POKETEXT, pid, savedregs.rip, word) == -1) {
         perror("ptrace(PTRACE_POKETEXT)");
@@ -358,6 +824,12 @@ main(int const argc, char *const *const argv)
         return 2;
     }
 
+    if (!ret && maplength && argc - 3 <= optind &&
+        printf("%#lx\n", mapaddr) < 0) {
+        perror("printf");
+        return 2;
+    }
+
     if (ret || argc - 3 <= optind)
         return ret;
 
@@ -382,12 +854,25 @@ main(int const argc, char *const *const argv)
         }
     }
 
-    if (ptrace(PTRACE_DETACH, pid, 0, 0) == -1) {
+    if (eflag && maplength) {
+        char buf[2 + 16 + 1];
+        int const sz = snprintf(buf, sizeof buf, "%#lx", mapaddr);
+        if (sz < 0) {
+            perror("snprintf");
+            return 2;
+        }
+        if (setenv("PSENDFD_ADDR", buf, 1) == -1) {
+            perror("setenv");
+            return 2;
+        }
+    }
+
+    if (TRACE("ptrace", ptrace(PTRACE_DETACH, pid, 0, 0)) == -1) {
         perror("ptrace(PTRACE_DETACH)");
         return 2;
     }
 
-    (void)execvp(argv[optind + 3], &argv[optind + 3]);
+    (void)trace_execvp(argv[optind + 3], &argv[optind + 3]);
     perror("execvp");
     return 2;
 }
@@ -7,10 +7,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static int
 retryeintr_open(char const *const path, int const flags)
 {
-    int const fd = open(path, flags);
+    int const fd = TRACE("open", open(path, flags));
     if (fd != -1 || errno != EINTR)
         return fd;
     return retryeintr_open(path, flags);
@@ -19,7 +21,7 @@ retryeintr_open(char const *const path, int const flags)
 static int
 retryeintr_dup2(int const oldfd, int const newfd)
 {
-    int const ret = dup2(oldfd, newfd);
+    int const ret = TRACE("dup2", dup2(oldfd, newfd));
     if (ret != -1 || errno != EINTR)
         return ret;
     return retryeintr_dup2(oldfd, newfd);
@@ -28,7 +30,7 @@ retryeintr_dup2(int const oldfd, int const newfd)
 static int
 retryeintr_close(int const fd)
 {
-    int const ret = close(fd);
+    int const ret = TRACE("close", close(fd));
     if (ret != -1 || errno != EINTR)
         return ret;
     return retryeintr_close(fd);
@@ -89,6 +91,7 @@ usage(void)
 int
 main(int const argc, char *const *const argv)
 {
+    trace_init("ptytty");
     int ptflags = O_RDWR;
     for (int opt; opt = getopt(argc, argv, "+N"), opt != -1;) {
         switch (opt) {
@@ -138,7 +141,7 @@ main(int const argc, char *const *const argv)
     if (opentofd(ttyfd, ttypath, O_RDWR) == -1)
         return 2;
 
-    (void)execvp(*cmd, cmd);
+    (void)trace_execvp(*cmd, cmd);
     perror("execvp");
     return 2;
 }
@@ -1,30 +1,155 @@
 #include <errno.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <linux/capability.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include "emanutrace.h"
+
 static void
 usage(void)
 {
-    static char const msg[] = "Usage: secretmemfd fd cmd [args]...\n";
+    static char const msg[] =
+        "Usage: secretmemfd [-e] [-s size [-F]] fd cmd [args]...\n";
     if (fputs(msg, stderr) == EOF)
         perror("fputs");
 }
 
+/* bytes, with an optional k, m or g suffix for KiB, MiB or GiB */
+static bool
+str2size(char const *const str, off_t *const sizep)
+{
+    char *endptr;
+    errno = 0;
+    long long const num = strtoll(str, &endptr, 10);
+    if (errno) {
+        perror("strtoll");
+        return false;
+    }
+    int shift = 0;
+    switch (*endptr) {
+    case 'g': case 'G':
+        shift += 10;
+        /* fallthrough */
+    case 'm': case 'M':
+        shift += 10;
+        /* fallthrough */
+    case 'k': case 'K':
+        shift += 10;
+        ++endptr;
+    }
+    if (endptr == str || num < 0 || *endptr || num > INT64_MAX >> shift) {
+        if (fputs("Invalid size.\n", stderr) == EOF)
+            perror("fputs");
+        return false;
+    }
+    *sizep = (off_t)(num << shift);
+    return true;
+}
+
+/* CAP_IPC_LOCK lifts RLIMIT_MEMLOCK for secretmem mappings too */
+static bool
+unlimited(void)
+{
+    struct __user_cap_header_struct header = {
+        .version = _LINUX_CAPABILITY_VERSION_3,
+    };
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+    if (TRACE("capget", syscall(SYS_capget, &header, data)) == -1)
+        return false;
+    return data[CAP_TO_INDEX(CAP_IPC_LOCK)].effective &
+           CAP_TO_MASK(CAP_IPC_LOCK);
+}
+
+/*
+ * a mapping of secret memory is charged to RLIMIT_MEMLOCK like mlock(2)
+ * is, so a memfd that cmd could not map as a whole is refused up front;
+ * the limit left once it is mapped is stored in *leftp, -1 for none
+ */
+static bool
+checkbudget(off_t const size, long long *const leftp)
+{
+    struct rlimit rl;
+    if (TRACE("getrlimit", getrlimit(RLIMIT_MEMLOCK, &rl)) == -1) {
+        perror("getrlimit");
+        return false;
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || unlimited()) {
+        *leftp = -1;
+        return true;
+    }
+    long const pagesize = sysconf(_SC_PAGESIZE);
+    unsigned long long const need =
+        ((unsigned long long)size + pagesize - 1) / pagesize * pagesize;
+    if (need > rl.rlim_cur) {
+        static char const efmt[] =
+            "secretmemfd: %llu bytes exceed RLIMIT_MEMLOCK of %llu.\n";
+        if (fprintf(stderr, efmt, need,
+                    (unsigned long long)rl.rlim_cur) < 0) {
+            perror("fprintf");
+        }
+        return false;
+    }
+    unsigned long long const left = rl.rlim_cur - need;
+    *leftp = left > LLONG_MAX ? LLONG_MAX : (long long)left;
+    return true;
+}
+
+/* secret memory cannot be populated by MAP_POPULATE, touch every page */
+static bool
+prefault(int const memfd, off_t const size)
+{
+    char *const map = TRACE("mmap", mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED, memfd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    long const pagesize = sysconf(_SC_PAGESIZE);
+    for (off_t off = 0; off < size; off += pagesize)
+        ((char volatile *)map)[off] = 0;
+    (void)munmap(map, size);
+    return true;
+}
+
 int
 main(int const argc, char *const *const argv)
 {
-    for (int opt; opt = getopt(argc, argv, "+"), opt != -1;) {
+    trace_init("secretmemfd");
+    bool envflag = false;
+    bool faultin = false;
+    off_t size = 0;
+    for (int opt; opt = getopt(argc, argv, "+eFs:"), opt != -1;) {
         switch (opt) {
+        case 'e':
+            envflag = true;
+            break;
+        case 'F':
+            faultin = true;
+            break;
+        case 's':
+            if (!str2size(optarg, &size))
+                return 2;
+            break;
         default:
             usage();
             return 2;
         }
     }
 
+    if (faultin && !size) {
+        if (fputs("-F needs a nonzero size from -s.\n", stderr) == EOF)
+            perror("fputs");
+        return 2;
+    }
+
     if (argc - optind < 2) {
         usage();
         return 2;
@@ -45,23 +170,40 @@ main(int const argc, char *const *const argv)
     }
     int const fd = (int)longfd;
 
-    int const memfd = syscall(SYS_memfd_secret, 0);
+    long long left = -1;
+    if ((size || envflag) && !checkbudget(size, &left))
+        return 2;
+
+    int const memfd = TRACE("memfd_secret", syscall(SYS_memfd_secret, 0));
     if (memfd == -1) {
         perror("memfd_secret");
         return 2;
     }
 
+    if (size) {
+        int ret;
+        do {
+            ret = TRACE("ftruncate", ftruncate(memfd, size));
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            perror("ftruncate");
+            return 2;
+        }
+        if (faultin && !prefault(memfd, size))
+            return 2;
+    }
+
     if (memfd != fd) {
         int ret;
         do {
-            ret = dup2(memfd, fd);
+            ret = TRACE("dup2", dup2(memfd, fd));
         } while (ret == -1 && errno == EINTR);
         if (ret == -1) {
             perror("dup2");
             return 2;
         }
         do {
-            ret = close(memfd);
+            ret = TRACE("close", close(memfd));
         } while (ret == -1 && errno == EINTR);
         if (ret == -1) {
             perror("close");
@@ -69,7 +211,23 @@ main(int const argc, char *const *const argv)
         }
     }
 
-    (void)execvp(argv[optind + 1], &argv[optind + 1]);
+    if (envflag) {
+        char buf[3 * sizeof left + 1];
+        char const *str = "unlimited";
+        if (left != -1) {
+            if (snprintf(buf, sizeof buf, "%lld", left) < 0) {
+                perror("snprintf");
+                return 2;
+            }
+            str = buf;
+        }
+        if (setenv("SECRETMEMFD_MEMLOCK", str, 1) == -1) {
+            perror("setenv");
+            return 2;
+        }
+    }
+
+    (void)trace_execvp(argv[optind + 1], &argv[optind + 1]);
     perror("execvp");
     return 2;
 }
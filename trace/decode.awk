@@ -0,0 +1,102 @@
+#!/usr/bin/awk -f
+# Rebuild per-chain timelines from EMANUTILS_TRACEFD records.
+#
+# A chain is every record sharing a pid, since each link execs the next
+# one in the same process; processes spawned by a traced process (e.g.
+# chainif conditions) are listed after it.  Times are in microseconds,
+# relative to the start of the chain; "gap" is the time between a link
+# and the previous one, i.e. mostly the cost of execve(2).
+#
+# Usage: awk -f trace/decode.awk tracefile...
+
+function us(ns) {
+    return sprintf("%.1f", ns / 1000)
+}
+
+{
+    delete f
+    for (i = 1; i <= NF; ++i) {
+        eq = index($i, "=")
+        if (eq)
+            f[substr($i, 1, eq - 1)] = substr($i, eq + 1)
+    }
+    if (!("pid" in f) || !("start" in f))
+        next
+    pid = f["pid"]
+    if (!(pid in nrecs)) {
+        pids[++npids] = pid
+        ppid[pid] = f["ppid"]
+    }
+    n = ++nrecs[pid]
+    tool[pid, n] = f["tool"]
+    start[pid, n] = f["start"] + 0
+    end[pid, n] = f["end"] + 0
+    outcome[pid, n] = f["exit"]
+    calls[pid, n] = f["calls"]
+}
+
+function sortrecs(pid,    i, j, n, tmp) {
+    n = nrecs[pid]
+    for (i = 2; i <= n; ++i) {
+        for (j = i; j > 1 && start[pid, j] < start[pid, j - 1]; --j) {
+            tmp = tool[pid, j]; tool[pid, j] = tool[pid, j - 1]
+            tool[pid, j - 1] = tmp
+            tmp = start[pid, j]; start[pid, j] = start[pid, j - 1]
+            start[pid, j - 1] = tmp
+            tmp = end[pid, j]; end[pid, j] = end[pid, j - 1]
+            end[pid, j - 1] = tmp
+            tmp = outcome[pid, j]; outcome[pid, j] = outcome[pid, j - 1]
+            outcome[pid, j - 1] = tmp
+            tmp = calls[pid, j]; calls[pid, j] = calls[pid, j - 1]
+            calls[pid, j - 1] = tmp
+        }
+    }
+}
+
+function showcalls(str,    n, i, c, part, out) {
+    n = split(str, c, ",")
+    out = ""
+    for (i = 1; i <= n; ++i) {
+        split(c[i], part, ":")
+        out = out sprintf(" %s=%sx%sus", part[1], part[2], us(part[3]))
+        if (part[4] > 0)
+            out = out "!" part[4]
+    }
+    return out
+}
+
+function showchain(pid, indent,    i, n, base, parent, p) {
+    shown[pid] = 1
+    n = nrecs[pid]
+    base = start[pid, 1]
+    parent = ""
+    if (ppid[pid] in nrecs)
+        parent = " spawned by " tool[ppid[pid], nrecs[ppid[pid]]]
+    printf "%spid %s%s: %d link%s, %sus\n", indent, pid, parent, n,
+        n == 1 ? "" : "s", us(end[pid, n] - base)
+    for (i = 1; i <= n; ++i) {
+        printf "%s  +%-12s %-12s %10sus", indent,
+            us(start[pid, i] - base) "us",
+            tool[pid, i], us(end[pid, i] - start[pid, i])
+        if (i > 1)
+            printf " gap=%sus", us(start[pid, i] - end[pid, i - 1])
+        printf " exit=%s%s\n", outcome[pid, i], showcalls(calls[pid, i])
+    }
+    for (p = 1; p <= npids; ++p) {
+        if (!(pids[p] in shown) && ppid[pids[p]] == pid)
+            showchain(pids[p], indent "    ")
+    }
+}
+
+END {
+    for (p = 1; p <= npids; ++p)
+        sortrecs(pids[p])
+    for (p = 1; p <= npids; ++p) {
+        if (!(pids[p] in shown) && !(ppid[pids[p]] in nrecs))
+            showchain(pids[p], "")
+    }
+    for (p = 1; p <= npids; ++p) {
+        if (!(pids[p] in shown))
+            showchain(pids[p], "")
+    }
+}